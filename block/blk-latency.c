@@ -0,0 +1,177 @@
+/*
+ * Per-queue request latency histograms
+ *
+ * For every file system request we note when it was allocated, when it was
+ * handed to the driver and when it completed, and account the time spent in
+ * the queue (allocation to dispatch), at the driver (dispatch to completion)
+ * and in total in log2 histograms, split by data direction and sync/async.
+ * This is independent of the elevator in use, so schedulers can be compared
+ * on real traffic without the overhead of blktrace.
+ *
+ * Accounting is off by default; write 1 to /sys/block/<dev>/queue/latency_stats
+ * to (re)start it and 0 to stop it. The histograms are read from
+ * /sys/block/<dev>/queue/latency_hist.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+
+#include "blk.h"
+
+/*
+ * Bucket 0 counts latencies below BLK_LAT_MIN_US, bucket i > 0 those in
+ * [BLK_LAT_MIN_US << (i - 1), BLK_LAT_MIN_US << i), and the last bucket
+ * everything above.
+ */
+#define BLK_LAT_MIN_US		16
+#define BLK_LAT_BUCKETS		18
+
+enum {
+	BLK_LAT_QUEUE,		/* allocated to dispatched */
+	BLK_LAT_DRIVER,		/* dispatched to completed */
+	BLK_LAT_TOTAL,		/* allocated to completed */
+	BLK_LAT_NR,
+};
+
+static const char *blk_lat_names[BLK_LAT_NR] = {
+	[BLK_LAT_QUEUE]		= "queue",
+	[BLK_LAT_DRIVER]	= "driver",
+	[BLK_LAT_TOTAL]		= "total",
+};
+
+struct blk_latency_stats {
+	/* [data direction][sync][phase][bucket], protected by queue_lock */
+	unsigned long hist[2][2][BLK_LAT_NR][BLK_LAT_BUCKETS];
+};
+
+static inline u64 blk_lat_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline int blk_lat_bucket(u64 ns)
+{
+	unsigned long us = div_u64(ns, NSEC_PER_USEC) / BLK_LAT_MIN_US;
+
+	return min_t(int, fls_long(us), BLK_LAT_BUCKETS - 1);
+}
+
+/* Called from blk_rq_init() */
+void blk_latency_init(struct request_queue *q, struct request *rq)
+{
+	if (q && q->latency_stats)
+		rq->lat_start_ns = blk_lat_now();
+}
+
+/* Called with queue_lock held when the driver takes the request */
+void blk_latency_dispatch(struct request *rq)
+{
+	if (rq->lat_start_ns)
+		rq->lat_dispatch_ns = blk_lat_now();
+}
+
+/* Called with queue_lock held when the request completes */
+void blk_latency_done(struct request *rq)
+{
+	struct blk_latency_stats *stats = rq->q->latency_stats;
+	unsigned long (*hist)[BLK_LAT_BUCKETS];
+	u64 now;
+
+	if (!stats || !rq->lat_start_ns || !rq->lat_dispatch_ns ||
+	    rq->cmd_type != REQ_TYPE_FS)
+		return;
+
+	now = blk_lat_now();
+	hist = stats->hist[rq_data_dir(rq)][rq_is_sync(rq)];
+	hist[BLK_LAT_QUEUE][blk_lat_bucket(rq->lat_dispatch_ns -
+					   rq->lat_start_ns)]++;
+	hist[BLK_LAT_DRIVER][blk_lat_bucket(now - rq->lat_dispatch_ns)]++;
+	hist[BLK_LAT_TOTAL][blk_lat_bucket(now - rq->lat_start_ns)]++;
+}
+
+void blk_latency_exit(struct request_queue *q)
+{
+	kfree(q->latency_stats);
+	q->latency_stats = NULL;
+}
+
+ssize_t blk_latency_stats_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%d\n", q->latency_stats != NULL);
+}
+
+ssize_t blk_latency_stats_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	struct blk_latency_stats *stats = NULL, *old;
+	unsigned long val;
+
+	if (strict_strtoul(page, 10, &val))
+		return -EINVAL;
+
+	if (val) {
+		stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats)
+			return -ENOMEM;
+	}
+
+	spin_lock_irq(q->queue_lock);
+	old = q->latency_stats;
+	q->latency_stats = stats;
+	spin_unlock_irq(q->queue_lock);
+
+	kfree(old);
+	return count;
+}
+
+ssize_t blk_latency_hist_show(struct request_queue *q, char *page)
+{
+	struct blk_latency_stats *stats;
+	unsigned long *snap;
+	ssize_t len;
+	int dir, sync, phase, i;
+
+	snap = kmalloc(sizeof(stats->hist), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	spin_lock_irq(q->queue_lock);
+	stats = q->latency_stats;
+	if (stats)
+		memcpy(snap, stats->hist, sizeof(stats->hist));
+	spin_unlock_irq(q->queue_lock);
+
+	if (!stats) {
+		kfree(snap);
+		return sprintf(page, "disabled\n");
+	}
+
+	len = sprintf(page, "usecs");
+	for (i = 0; i < BLK_LAT_BUCKETS; i++)
+		len += scnprintf(page + len, PAGE_SIZE - len, " %u",
+			       i ? BLK_LAT_MIN_US << (i - 1) : 0);
+	len += scnprintf(page + len, PAGE_SIZE - len, "\n");
+
+	for (dir = READ; dir <= WRITE; dir++)
+		for (sync = 0; sync < 2; sync++)
+			for (phase = 0; phase < BLK_LAT_NR; phase++) {
+				unsigned long *h = snap + ((dir * 2 + sync) *
+						BLK_LAT_NR + phase) * BLK_LAT_BUCKETS;
+
+				len += scnprintf(page + len, PAGE_SIZE - len,
+						"%s_%s_%s",
+						dir == READ ? "read" : "write",
+						sync ? "sync" : "async",
+						blk_lat_names[phase]);
+				for (i = 0; i < BLK_LAT_BUCKETS; i++)
+					len += scnprintf(page + len,
+							PAGE_SIZE - len,
+							" %lu", h[i]);
+				len += scnprintf(page + len, PAGE_SIZE - len,
+						"\n");
+			}
+
+	kfree(snap);
+	return min_t(ssize_t, len, PAGE_SIZE - 1);
+}
@@ -379,6 +379,19 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+#ifdef CONFIG_BLK_DEV_LATENCY_STATS
+static struct queue_sysfs_entry queue_latency_stats_entry = {
+	.attr = {.name = "latency_stats", .mode = S_IRUGO | S_IWUSR },
+	.show = blk_latency_stats_show,
+	.store = blk_latency_stats_store,
+};
+
+static struct queue_sysfs_entry queue_latency_hist_entry = {
+	.attr = {.name = "latency_hist", .mode = S_IRUGO },
+	.show = blk_latency_hist_show,
+};
+#endif
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -401,6 +414,10 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+#ifdef CONFIG_BLK_DEV_LATENCY_STATS
+	&queue_latency_stats_entry.attr,
+	&queue_latency_hist_entry.attr,
+#endif
 	NULL,
 };
 
@@ -473,6 +490,8 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_throtl_exit(q);
 
+	blk_latency_exit(q);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
@@ -169,4 +169,21 @@ static inline int blk_do_io_stat(struct request *rq)
 	        (rq->cmd_flags & REQ_DISCARD));
 }
 
+#ifdef CONFIG_BLK_DEV_LATENCY_STATS
+void blk_latency_init(struct request_queue *q, struct request *rq);
+void blk_latency_dispatch(struct request *rq);
+void blk_latency_done(struct request *rq);
+void blk_latency_exit(struct request_queue *q);
+ssize_t blk_latency_stats_show(struct request_queue *q, char *page);
+ssize_t blk_latency_stats_store(struct request_queue *q, const char *page,
+				size_t count);
+ssize_t blk_latency_hist_show(struct request_queue *q, char *page);
+#else
+static inline void blk_latency_init(struct request_queue *q,
+				    struct request *rq) {}
+static inline void blk_latency_dispatch(struct request *rq) {}
+static inline void blk_latency_done(struct request *rq) {}
+static inline void blk_latency_exit(struct request_queue *q) {}
+#endif
+
 #endif
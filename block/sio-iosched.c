@@ -12,6 +12,13 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * Optionally (sorted=1), requests are also kept sorted by sector per data
+ * direction and dispatched in batches of up to fifo_batch requests in
+ * ascending sector order, as deadline does. A batch keeps to one direction;
+ * we stay in that direction for locality until the other one has waited
+ * for reads_starved (resp. writes_starved) batches. Expired requests still
+ * start a batch of their own, so the fifo deadlines hold in both modes.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -19,6 +26,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/rbtree.h>
 
 enum {
 	ASYNC,
@@ -30,24 +38,112 @@ static const int sync_expire = HZ / 2;	/* max time before a sync is submitted. *
 static const int async_expire = 5 * HZ;	/* ditto for async, these limits are SOFT! */
 static const int fifo_batch = 16;	/* # of sequential requests treated as one
 					   by the above parameters. For throughput. */
+static const int reads_starved = 1;	/* max write batches while reads wait */
+static const int writes_starved = 2;	/* max read batches while writes wait */
 
 /* Elevator data */
 struct sio_data {
 	/* Request queues */
 	struct list_head fifo_list[2];
 
+	/* Sector-sorted requests, by data direction */
+	struct rb_root sort_list[2];
+
 	/* Attributes */
 	unsigned int batched;
+	struct request *next_rq[2];	/* next in sort order */
+	int last_dir;			/* direction of the current batch */
+	unsigned int starved[2];	/* batches each direction has waited */
 
 	/* Settings */
 	int fifo_expire[2];
 	int fifo_batch;
+	int sorted;
+	int starved_limit[2];
 };
 
+static void sio_dispatch_request(struct sio_data *sd, struct request *rq);
+
+static inline struct rb_root *
+sio_rb_root(struct sio_data *sd, struct request *rq)
+{
+	return &sd->sort_list[rq_data_dir(rq)];
+}
+
+/*
+ * Get the request after `rq' in sector-sorted order
+ */
+static inline struct request *
+sio_latter_rq(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+static void
+sio_add_rq_rb(struct sio_data *sd, struct request *rq)
+{
+	struct rb_root *root = sio_rb_root(sd, rq);
+	struct request *__alias;
+
+	/* A request for the same sector is already queued: send it off */
+	while (unlikely(__alias = elv_rb_add(root, rq)))
+		sio_dispatch_request(sd, __alias);
+}
+
+static inline void
+sio_del_rq_rb(struct sio_data *sd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	if (sd->next_rq[data_dir] == rq)
+		sd->next_rq[data_dir] = sio_latter_rq(rq);
+
+	elv_rb_del(sio_rb_root(sd, rq), rq);
+}
+
+static int
+sio_merge(struct request_queue *q, struct request **req, struct bio *bio)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	sector_t sector = bio->bi_sector + bio_sectors(bio);
+	struct request *__rq;
+
+	/* Front merges need the sort lists, only look for them when sorting */
+	if (!sd->sorted)
+		return ELEVATOR_NO_MERGE;
+
+	__rq = elv_rb_find(&sd->sort_list[bio_data_dir(bio)], sector);
+	if (__rq && elv_rq_merge_ok(__rq, bio)) {
+		*req = __rq;
+		return ELEVATOR_FRONT_MERGE;
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+static void
+sio_merged_request(struct request_queue *q, struct request *req, int type)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+
+	/* A front merge moves the request's start sector: reposition it */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(sio_rb_root(sd, req), req);
+		sio_add_rq_rb(sd, req);
+	}
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
 {
+	struct sio_data *sd = q->elevator->elevator_data;
+
 	/*
 	 * If next expires before rq, assign its expire time to rq
 	 * and move into next position (next will be deleted) in fifo.
@@ -61,6 +157,7 @@ sio_merged_requests(struct request_queue *q, struct request *rq,
 
 	/* Delete next request */
 	rq_fifo_clear(next);
+	sio_del_rq_rb(sd, next);
 }
 
 static void
@@ -73,6 +170,8 @@ sio_add_request(struct request_queue *q, struct request *rq)
 	 * Add request to the proper fifo list and set its
 	 * expire time.
 	 */
+	sio_add_rq_rb(sd, rq);
+
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync]);
 	list_add_tail(&rq->queuelist, &sd->fifo_list[sync]);
 }
@@ -140,25 +239,86 @@ sio_choose_request(struct sio_data *sd)
 	return NULL;
 }
 
-static inline void
+static void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
+	const int data_dir = rq_data_dir(rq);
+
+	/* Remember where a sorted batch would continue */
+	sd->next_rq[READ] = NULL;
+	sd->next_rq[WRITE] = NULL;
+	sd->next_rq[data_dir] = sio_latter_rq(rq);
+
 	/*
-	 * Remove the request from the fifo list
+	 * Remove the request from the fifo and sort lists
 	 * and dispatch it.
 	 */
 	rq_fifo_clear(rq);
+	sio_del_rq_rb(sd, rq);
 	elv_dispatch_add_tail(rq->q, rq);
 
 	sd->batched++;
 }
 
+static int
+sio_dispatch_sorted(struct sio_data *sd)
+{
+	const int reads = !RB_EMPTY_ROOT(&sd->sort_list[READ]);
+	const int writes = !RB_EMPTY_ROOT(&sd->sort_list[WRITE]);
+	struct request *rq;
+	int data_dir;
+
+	/* Batches are reads XOR writes: carry on with the current one */
+	rq = sd->next_rq[WRITE] ? sd->next_rq[WRITE] : sd->next_rq[READ];
+	if (rq && sd->batched < sd->fifo_batch)
+		goto dispatch;
+
+	if (!reads && !writes)
+		return 0;
+
+	/* An expired request starts a new batch from its position */
+	rq = sio_choose_expired_request(sd);
+	if (rq) {
+		data_dir = rq_data_dir(rq);
+		goto new_batch;
+	}
+
+	/*
+	 * Otherwise stay in the current direction for locality, unless it
+	 * has run dry or the other direction has waited long enough.
+	 */
+	data_dir = sd->last_dir;
+	if (RB_EMPTY_ROOT(&sd->sort_list[data_dir]) ||
+	    (!RB_EMPTY_ROOT(&sd->sort_list[!data_dir]) &&
+	     sd->starved[!data_dir] >= sd->starved_limit[!data_dir]))
+		data_dir = !data_dir;
+
+	rq = sd->next_rq[data_dir];
+	if (!rq)
+		rq = rb_entry_rq(rb_first(&sd->sort_list[data_dir]));
+
+new_batch:
+	sd->batched = 0;
+	sd->last_dir = data_dir;
+	sd->starved[data_dir] = 0;
+	if (!RB_EMPTY_ROOT(&sd->sort_list[!data_dir]))
+		sd->starved[!data_dir]++;
+
+dispatch:
+	sio_dispatch_request(sd, rq);
+
+	return 1;
+}
+
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
 	struct request *rq = NULL;
 
+	if (sd->sorted)
+		return sio_dispatch_sorted(sd);
+
 	/*
 	 * Retrieve any expired request after a batch of
 	 * sequential requests.
@@ -187,6 +347,9 @@ sio_former_request(struct request_queue *q, struct request *rq)
 	struct sio_data *sd = q->elevator->elevator_data;
 	const int sync = rq_is_sync(rq);
 
+	if (sd->sorted)
+		return elv_rb_former_request(q, rq);
+
 	if (rq->queuelist.prev == &sd->fifo_list[sync])
 		return NULL;
 
@@ -200,6 +363,9 @@ sio_latter_request(struct request_queue *q, struct request *rq)
 	struct sio_data *sd = q->elevator->elevator_data;
 	const int sync = rq_is_sync(rq);
 
+	if (sd->sorted)
+		return elv_rb_latter_request(q, rq);
+
 	if (rq->queuelist.next == &sd->fifo_list[sync])
 		return NULL;
 
@@ -220,12 +386,22 @@ sio_init_queue(struct request_queue *q)
 	/* Initialize fifo lists */
 	INIT_LIST_HEAD(&sd->fifo_list[SYNC]);
 	INIT_LIST_HEAD(&sd->fifo_list[ASYNC]);
+	sd->sort_list[READ] = RB_ROOT;
+	sd->sort_list[WRITE] = RB_ROOT;
 
 	/* Initialize data */
 	sd->batched = 0;
+	sd->next_rq[READ] = NULL;
+	sd->next_rq[WRITE] = NULL;
+	sd->last_dir = READ;
+	sd->starved[READ] = 0;
+	sd->starved[WRITE] = 0;
 	sd->fifo_expire[SYNC] = sync_expire;
 	sd->fifo_expire[ASYNC] = async_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->sorted = 0;
+	sd->starved_limit[READ] = reads_starved;
+	sd->starved_limit[WRITE] = writes_starved;
 
 	return sd;
 }
@@ -237,6 +413,8 @@ sio_exit_queue(struct elevator_queue *e)
 
 	BUG_ON(!list_empty(&sd->fifo_list[SYNC]));
 	BUG_ON(!list_empty(&sd->fifo_list[ASYNC]));
+	BUG_ON(!RB_EMPTY_ROOT(&sd->sort_list[READ]));
+	BUG_ON(!RB_EMPTY_ROOT(&sd->sort_list[WRITE]));
 
 	/* Free structure */
 	kfree(sd);
@@ -273,6 +451,9 @@ static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
 SHOW_FUNCTION(sio_sync_expire_show, sd->fifo_expire[SYNC], 1);
 SHOW_FUNCTION(sio_async_expire_show, sd->fifo_expire[ASYNC], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
+SHOW_FUNCTION(sio_sorted_show, sd->sorted, 0);
+SHOW_FUNCTION(sio_reads_starved_show, sd->starved_limit[READ], 0);
+SHOW_FUNCTION(sio_writes_starved_show, sd->starved_limit[WRITE], 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -294,6 +475,9 @@ static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)
 STORE_FUNCTION(sio_sync_expire_store, &sd->fifo_expire[SYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_async_expire_store, &sd->fifo_expire[ASYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_sorted_store, &sd->sorted, 0, 1, 0);
+STORE_FUNCTION(sio_reads_starved_store, &sd->starved_limit[READ], 0, INT_MAX, 0);
+STORE_FUNCTION(sio_writes_starved_store, &sd->starved_limit[WRITE], 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -304,11 +488,16 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(sync_expire),
 	DD_ATTR(async_expire),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(sorted),
+	DD_ATTR(reads_starved),
+	DD_ATTR(writes_starved),
 	__ATTR_NULL
 };
 
 static struct elevator_type iosched_sio = {
 	.ops = {
+		.elevator_merge_fn		= sio_merge,
+		.elevator_merged_fn		= sio_merged_request,
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
@@ -32,9 +32,15 @@
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 #include <linux/moduleparam.h>
+#include <linux/input.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
 #include <asm/cputime.h>
 #include <linux/earlysuspend.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpufreq_smartass.h>
+
 extern unsigned long get_cpuL1freq(void);
 extern unsigned long get_cpuminfreq(void);
 
@@ -115,6 +121,20 @@ static unsigned int sample_rate_jiffies;
 #define DEF_SMOOTH_UI (0)
 static unsigned int smooth_ui;
 
+/*
+ * The frequency to jump to straight away on touch or key input, instead of
+ * waiting for the sample timer to notice the load and ramp up step by step.
+ * Zero disables input boosting.
+ */
+#define DEFAULT_BOOST_FREQ 0
+static unsigned int boost_freq;
+
+/*
+ * How long after the last input event we stay at or above boost_freq.
+ */
+#define DEFAULT_BOOST_DURATION_US 500000
+static unsigned long boost_duration_us;
+
 /*************** End of tunables ***************/
 
 extern unsigned int touch_state_val;
@@ -135,6 +155,7 @@ struct smartass_info_s {
 	int ramp_dir;
 	unsigned int enable;
 	int ideal_speed;
+	int boost_pending;
 };
 static DEFINE_PER_CPU(struct smartass_info_s, smartass_info);
 
@@ -148,6 +169,16 @@ static spinlock_t cpumask_lock;
 
 static unsigned int suspended;
 
+/* Input boost state: end of the boost window and time of the input event */
+static unsigned long boost_until;
+static ktime_t boost_input_time;
+static int input_registered;
+
+static inline int smartass_boosted(void)
+{
+	return boost_freq && time_before(jiffies, boost_until);
+}
+
 #define dprintk(flag,msg...) do { \
 	if (debug_mask & flag) printk(KERN_DEBUG msg); \
 	} while (0)
@@ -268,6 +299,7 @@ inline static int target_freq(struct cpufreq_policy *policy, struct smartass_inf
 	else target = new_freq;
 
 	__cpufreq_driver_target(policy, target, prefered_relation);
+	trace_cpufreq_smartass_target(policy->cpu, old_freq, new_freq, target);
 
 	dprintk(SMARTASS_DEBUG_JUMPS,"SmartassQ: jumping from %d to %d => %d (%d)\n",
 		old_freq,new_freq,target,policy->cur);
@@ -335,6 +367,7 @@ static void cpufreq_smartass_timer(unsigned long cpu)
 	// Similarly for scale down: load should be below min and if we are at or below ideal
 	// frequency we require that we have been at this frequency for at least down_rate_us:
 	else if (cpu_load < min_cpu_load && old_freq > policy->min &&
+		 !(smartass_boosted() && old_freq <= boost_freq) &&
 		 (old_freq > this_smartass->ideal_speed ||
 		  cputime64_sub(update_time, this_smartass->freq_change_time) >= down_rate_us))
 	{
@@ -390,11 +423,30 @@ static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
 		if (!work_cpumask_test_and_clear(cpu))
 			continue;
 
+		policy = this_smartass->cur_policy;
+
+		if (this_smartass->boost_pending) {
+			// input boost: jump to boost_freq unless already above it
+			this_smartass->boost_pending = 0;
+			this_smartass->ramp_dir = 0;
+			old_freq = policy->cur;
+			new_freq = max_t(int, old_freq, boost_freq);
+			new_freq = target_freq(policy,this_smartass,new_freq,old_freq,
+					       CPUFREQ_RELATION_L);
+			trace_cpufreq_smartass_boost(cpu, old_freq, policy->cur,
+				ktime_us_delta(ktime_get(), boost_input_time));
+			if (new_freq)
+				this_smartass->freq_change_time_in_idle =
+					get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
+			if (policy->cur < policy->max)
+				reset_timer(cpu,this_smartass);
+			continue;
+		}
+
 		ramp_dir = this_smartass->ramp_dir;
 		this_smartass->ramp_dir = 0;
 
 		old_freq = this_smartass->old_freq;
-		policy = this_smartass->cur_policy;
 
 		if (old_freq != policy->cur) {
 			// frequency was changed by someone else?
@@ -433,6 +485,9 @@ static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
 				if (new_freq > old_freq) // min_cpu_load > max_cpu_load ?!
 					new_freq = old_freq -1;
 			}
+			// do not drop below the boost frequency while boosted:
+			if (smartass_boosted() && new_freq < (int)boost_freq)
+				new_freq = boost_freq;
 			dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp down: ramp_dir=%d ideal=%d\n",
 				old_freq,ramp_dir,this_smartass->ideal_speed);
 		}
@@ -648,6 +703,36 @@ static ssize_t store_smooth_ui(struct kobject *kobj, struct attribute *attr, con
 	return count;
 }
 
+static ssize_t show_boost_freq(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", boost_freq);
+}
+
+static ssize_t store_boost_freq(struct kobject *kobj, struct attribute *attr, const char *buf, size_t count)
+{
+	ssize_t res;
+	unsigned long input;
+	res = strict_strtoul(buf, 0, &input);
+	if (res >= 0)
+		boost_freq = input;
+	return count;
+}
+
+static ssize_t show_boost_duration_us(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boost_duration_us);
+}
+
+static ssize_t store_boost_duration_us(struct kobject *kobj, struct attribute *attr, const char *buf, size_t count)
+{
+	ssize_t res;
+	unsigned long input;
+	res = strict_strtoul(buf, 0, &input);
+	if (res >= 0 && input <= 100000000)
+		boost_duration_us = input;
+	return count;
+}
+
 #define define_global_rw_attr(_name)		\
 static struct global_attr _name##_attr =	\
 	__ATTR(_name, 0644, show_##_name, store_##_name)
@@ -664,6 +749,8 @@ define_global_rw_attr(ramp_down_step);
 define_global_rw_attr(max_cpu_load);
 define_global_rw_attr(min_cpu_load);
 define_global_rw_attr(smooth_ui);
+define_global_rw_attr(boost_freq);
+define_global_rw_attr(boost_duration_us);
 
 static struct attribute * smartass_attributes[] = {
 	&debug_mask_attr.attr,
@@ -678,6 +765,8 @@ static struct attribute * smartass_attributes[] = {
 	&max_cpu_load_attr.attr,
 	&min_cpu_load_attr.attr,
 	&smooth_ui_attr.attr,
+	&boost_freq_attr.attr,
+	&boost_duration_us_attr.attr,
 	NULL,
 };
 
@@ -720,6 +809,9 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 
 			pm_idle_old = pm_idle;
 			pm_idle = cpufreq_idle;
+
+			// forget any boost left over from a previous run
+			boost_until = jiffies;
 		}
 
 		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
@@ -764,6 +856,114 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 	return 0;
 }
 
+/*
+ * Input boost: on touch or key input, jump every active cpu to boost_freq
+ * right away and keep it there for boost_duration_us after the last event.
+ * Runs in atomic context, the actual frequency change is done by the
+ * (high priority) ramp up work.
+ */
+static void smartass_input_event(struct input_handle *handle,
+		unsigned int type, unsigned int code, int value)
+{
+	unsigned long now = jiffies;
+	int was_boosted;
+	unsigned int i;
+
+	if (!boost_freq || suspended || !atomic_read(&active_count))
+		return;
+	if (type != EV_ABS && type != EV_KEY)
+		return;
+
+	was_boosted = smartass_boosted();
+	boost_until = now + usecs_to_jiffies(boost_duration_us);
+	if (was_boosted)
+		return;
+
+	boost_input_time = ktime_get();
+	trace_cpufreq_smartass_input(type, code);
+
+	for_each_online_cpu(i) {
+		struct smartass_info_s *this_smartass = &per_cpu(smartass_info, i);
+		if (!this_smartass->enable)
+			continue;
+		this_smartass->boost_pending = 1;
+		work_cpumask_set(i);
+	}
+	queue_work(up_wq, &freq_scale_work);
+}
+
+static int smartass_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_smartass";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void smartass_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id smartass_input_ids[] = {
+	/* multi-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	/* single-touch touchscreens and touchpads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	/* keypads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler smartass_input_handler = {
+	.event		= smartass_input_event,
+	.connect	= smartass_input_connect,
+	.disconnect	= smartass_input_disconnect,
+	.name		= "cpufreq_smartass",
+	.id_table	= smartass_input_ids,
+};
+
 static void smartass_suspend(int cpu, int suspend)
 {
 	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, smp_processor_id());
@@ -844,6 +1044,10 @@ static int __init cpufreq_smartass_init(void)
 	ramp_down_step = min_freq * 2;
 	max_cpu_load = DEFAULT_MAX_CPU_LOAD;
 	min_cpu_load = DEFAULT_MIN_CPU_LOAD;
+	boost_freq = DEFAULT_BOOST_FREQ;
+	boost_duration_us = DEFAULT_BOOST_DURATION_US;
+	// jiffies starts out negative, 0 would look like a pending boost
+	boost_until = jiffies;
 
 	spin_lock_init(&cpumask_lock);
 
@@ -860,6 +1064,7 @@ static int __init cpufreq_smartass_init(void)
 		this_smartass->freq_change_time = 0;
 		this_smartass->freq_change_time_in_idle = 0;
 		this_smartass->cur_cpu_load = 0;
+		this_smartass->boost_pending = 0;
 		// intialize timer:
 		init_timer_deferrable(&this_smartass->timer);
 		this_smartass->timer.function = cpufreq_smartass_timer;
@@ -880,6 +1085,10 @@ static int __init cpufreq_smartass_init(void)
 
 	register_early_suspend(&smartass_power_suspend);
 
+	input_registered = !input_register_handler(&smartass_input_handler);
+	if (!input_registered)
+		printk(KERN_WARNING "Smartass: failed to register input handler, input boost disabled\n");
+
 	return cpufreq_register_governor(&cpufreq_gov_smartass2);
 }
 
@@ -891,6 +1100,8 @@ module_init(cpufreq_smartass_init);
 
 static void __exit cpufreq_smartass_exit(void)
 {
+	if (input_registered)
+		input_unregister_handler(&smartass_input_handler);
 	cpufreq_unregister_governor(&cpufreq_gov_smartass2);
 	destroy_workqueue(up_wq);
 	destroy_workqueue(down_wq);
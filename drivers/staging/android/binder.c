@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -28,6 +29,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -36,7 +38,29 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview (outermost first):
+ *
+ * binder_main_lock   Held for read by every ioctl/poll so that procs and
+ *                    threads cannot disappear underneath it.  Held for
+ *                    write when tearing down procs and threads, setting
+ *                    the context manager and dumping debugfs state.
+ *                    Never held while a thread sleeps waiting for work.
+ * proc->lock         Per-proc; protects proc->threads.
+ * proc->alloc_lock   Per-proc; protects the buffer allocator (buffers,
+ *                    free/allocated trees, pages, free_async_space).
+ * binder_obj_lock    Protects the object graph shared between procs:
+ *                    nodes, refs, transaction stacks, thread error state,
+ *                    the todo lists and the thread pool counters.  Only
+ *                    held for short sections; payload copies, copies to
+ *                    the read buffer, buffer allocation and page
+ *                    mapping happen outside of it.
+ *
+ * Holding binder_main_lock for write excludes everybody else, so code
+ * running in that mode does not take the inner locks.
+ */
+static DECLARE_RWSEM(binder_main_lock);
+static DEFINE_MUTEX(binder_obj_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
@@ -47,7 +71,7 @@ static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -105,6 +129,11 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/* Number of unused buffer pages each proc keeps mapped for reuse */
+static int binder_page_pool_size = 8;
+module_param_named(page_pool_size, binder_page_pool_size, int,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -146,22 +175,97 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
+	atomic_t page_pool_hits;
+	atomic_t page_pool_misses;
 };
 
 static struct binder_stats binder_stats;
 
+/*
+ * Transaction latency histograms.  Bucket 0 counts transactions that took
+ * less than 1us, bucket n (n > 0) those that took [2^(n-1), 2^n) us and
+ * the last bucket everything slower.  Updated under binder_obj_lock.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+struct binder_latency_hist {
+	u32 delivery[BINDER_LATENCY_BUCKETS];	/* queued -> read by target */
+	u32 roundtrip[BINDER_LATENCY_BUCKETS];	/* call sent -> reply read */
+};
+
+static struct binder_latency_hist binder_latency;
+
+static inline int binder_latency_bucket(s64 us)
+{
+	if (us <= 0)
+		return 0;
+	return min_t(int, fls64(us), BINDER_LATENCY_BUCKETS - 1);
+}
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+enum binder_lock_types {
+	BINDER_LOCK_MAIN,
+	BINDER_LOCK_PROC,
+	BINDER_LOCK_ALLOC,
+	BINDER_LOCK_OBJ,
+	BINDER_LOCK_COUNT
+};
+
+struct binder_lock_stats {
+	atomic_t acquired[BINDER_LOCK_COUNT];
+	atomic_t contended[BINDER_LOCK_COUNT];
+};
+
+static struct binder_lock_stats binder_lock_stats;
+
+static void binder_mutex_lock(struct mutex *lock, enum binder_lock_types type)
+{
+	atomic_inc(&binder_lock_stats.acquired[type]);
+	if (mutex_trylock(lock))
+		return;
+	atomic_inc(&binder_lock_stats.contended[type]);
+	mutex_lock(lock);
+}
+
+static void binder_main_lock_read(void)
+{
+	atomic_inc(&binder_lock_stats.acquired[BINDER_LOCK_MAIN]);
+	if (down_read_trylock(&binder_main_lock))
+		return;
+	atomic_inc(&binder_lock_stats.contended[BINDER_LOCK_MAIN]);
+	down_read(&binder_main_lock);
+}
+
+static void binder_main_lock_write(void)
+{
+	atomic_inc(&binder_lock_stats.acquired[BINDER_LOCK_MAIN]);
+	if (down_write_trylock(&binder_main_lock))
+		return;
+	atomic_inc(&binder_lock_stats.contended[BINDER_LOCK_MAIN]);
+	down_write(&binder_main_lock);
+}
+
+static inline void binder_obj_lock_acquire(void)
+{
+	binder_mutex_lock(&binder_obj_lock, BINDER_LOCK_OBJ);
+}
+
+static inline void binder_obj_lock_release(void)
+{
+	mutex_unlock(&binder_obj_lock);
 }
 
 struct binder_transaction_log_entry {
@@ -273,6 +377,11 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+struct binder_lru_page {
+	struct list_head lru;	/* on proc->page_pool while unused */
+	struct page *page_ptr;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -281,6 +390,8 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex lock;
+	struct mutex alloc_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -299,12 +410,15 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	struct list_head page_pool;
+	int page_pool_count;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency_hist latency;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
@@ -355,8 +469,13 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	queued;		/* put on the target todo list */
+	ktime_t	call_start;	/* for a reply, when the call was queued */
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -607,6 +726,52 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static struct binder_lru_page *binder_lru_page_at(struct binder_proc *proc,
+						 void *page_addr)
+{
+	return &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+}
+
+static void binder_page_pool_stat(struct binder_proc *proc, int hit)
+{
+	if (hit) {
+		atomic_inc(&binder_stats.page_pool_hits);
+		atomic_inc(&proc->stats.page_pool_hits);
+	} else {
+		atomic_inc(&binder_stats.page_pool_misses);
+		atomic_inc(&proc->stats.page_pool_misses);
+	}
+}
+
+static void binder_page_pool_trim(struct binder_proc *proc,
+				  struct vm_area_struct *vma)
+{
+	struct binder_lru_page *lru_page;
+	void *page_addr;
+
+	while (proc->page_pool_count > binder_page_pool_size) {
+		lru_page = list_entry(proc->page_pool.prev,
+				      struct binder_lru_page, lru);
+		page_addr = proc->buffer + (lru_page - proc->pages) * PAGE_SIZE;
+
+		list_del_init(&lru_page->lru);
+		proc->page_pool_count--;
+		if (vma)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(lru_page->page_ptr);
+		lru_page->page_ptr = NULL;
+	}
+}
+
+/*
+ * Pages released by a buffer are not unmapped right away; they stay
+ * mapped on proc->page_pool so the next buffer that covers them does not
+ * pay for alloc_page, map_vm_area and vm_insert_page again.  Only when the
+ * pool grows beyond binder_page_pool_size are the oldest pages unmapped.
+ * Called with proc->alloc_lock held (or before the proc is published).
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +779,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *lru_page;
 	struct mm_struct *mm;
+	int need_map = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,7 +790,26 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
+	if (allocate) {
+		for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+			if (binder_lru_page_at(proc, page_addr)->page_ptr == NULL) {
+				need_map = 1;
+				break;
+			}
+		}
+	} else {
+		for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+			lru_page = binder_lru_page_at(proc, page_addr);
+			BUG_ON(lru_page->page_ptr == NULL);
+			BUG_ON(!list_empty(&lru_page->lru));
+			list_add(&lru_page->lru, &proc->page_pool);
+			proc->page_pool_count++;
+		}
+		if (proc->page_pool_count <= binder_page_pool_size)
+			return 0;
+	}
+
+	if (vma || (allocate && !need_map))
 		mm = NULL;
 	else
 		mm = get_task_mm(proc->tsk);
@@ -635,9 +820,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 
 	if (allocate == 0)
-		goto free_range;
+		goto trim;
 
-	if (vma == NULL) {
+	if (need_map && vma == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -647,11 +832,19 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		lru_page = binder_lru_page_at(proc, page_addr);
+
+		if (lru_page->page_ptr) {
+			BUG_ON(list_empty(&lru_page->lru));
+			list_del_init(&lru_page->lru);
+			proc->page_pool_count--;
+			binder_page_pool_stat(proc, 1);
+			continue;
+		}
+		binder_page_pool_stat(proc, 0);
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		lru_page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (lru_page->page_ptr == NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			       "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
@@ -659,7 +852,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &lru_page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -670,7 +863,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, lru_page->page_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			       "binder: %d: binder_alloc_buf failed "
@@ -686,27 +879,27 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(lru_page->page_ptr);
+	lru_page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
+	/* the pages set up so far are still good, keep them in the pool */
+	for (page_addr -= PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE) {
+		lru_page = binder_lru_page_at(proc, page_addr);
+		list_add(&lru_page->lru, &proc->page_pool);
+		proc->page_pool_count++;
 	}
+trim:
+	binder_page_pool_trim(proc, vma);
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	return allocate ? -ENOMEM : 0;
 }
 
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
@@ -975,7 +1168,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -1112,7 +1305,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1411,6 +1604,7 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error = BR_ERROR;
 
+	binder_obj_lock_acquire();
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
 	e->from_proc = proc->pid;
@@ -1517,6 +1711,14 @@ static void binder_transaction(struct binder_proc *proc,
 		target_wait = &target_proc->wait;
 	}
 	e->to_proc = target_proc->pid;
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	/*
+	 * target_proc and target_thread stay pinned by binder_main_lock,
+	 * held for read: they are only freed with it held for write. Their
+	 * transaction stacks are not, see the check below.
+	 */
+	binder_obj_lock_release();
 
 	/* TODO: reuse incoming transaction for reply */
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
@@ -1533,7 +1735,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1563,9 +1765,12 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+
+	binder_mutex_lock(&target_proc->alloc_lock, BINDER_LOCK_ALLOC);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
+		mutex_unlock(&target_proc->alloc_lock);
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
@@ -1573,8 +1778,7 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
+	mutex_unlock(&target_proc->alloc_lock);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1597,6 +1801,24 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
+	binder_obj_lock_acquire();
+	/*
+	 * The target thread may have moved on (e.g. been interrupted and
+	 * started a new transaction) while binder_obj_lock was dropped.
+	 */
+	if (reply && (target_thread->transaction_stack != in_reply_to ||
+		      in_reply_to->from != target_thread)) {
+		binder_user_error("binder: %d:%d reply target %d:%d "
+			"transaction stack changed from %d to %d\n",
+			proc->pid, thread->pid, target_proc->pid,
+			target_thread->pid, in_reply_to->debug_id,
+			target_thread->transaction_stack ?
+			target_thread->transaction_stack->debug_id : 0);
+		return_error = BR_FAILED_REPLY;
+		in_reply_to = NULL;
+		target_thread = NULL;
+		goto err_bad_object_offset;
+	}
 	off_end = (void *)offp + tr->offsets_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
@@ -1607,7 +1829,7 @@ static void binder_transaction(struct binder_proc *proc,
 				"invalid offset, %zd\n",
 				proc->pid, thread->pid, *offp);
 			return_error = BR_FAILED_REPLY;
-			goto err_bad_offset;
+			goto err_bad_object_offset;
 		}
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
@@ -1757,8 +1979,10 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->queued = ktime_get();
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		t->call_start = in_reply_to->queued;
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1778,8 +2002,10 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
+	trace_binder_transaction(reply, t, target_node, target_wait != NULL);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_obj_lock_release();
 	return;
 
 err_get_unused_fd_failed:
@@ -1789,11 +2015,17 @@ err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
+err_bad_object_offset:
+	/* drops the target_node reference through buffer->target_node */
+	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	target_node = NULL;
+	binder_obj_lock_release();
 err_bad_offset:
 err_copy_data_failed:
-	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	binder_mutex_lock(&target_proc->alloc_lock, BINDER_LOCK_ALLOC);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->alloc_lock);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1801,6 +2033,9 @@ err_alloc_tcomplete_failed:
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
+	binder_obj_lock_acquire();
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
@@ -1823,6 +2058,7 @@ err_no_context_mgr_node:
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
 		thread->return_error = return_error;
+	binder_obj_lock_release();
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1837,9 +2073,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1853,6 +2089,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_obj_lock_acquire();
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1871,6 +2108,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
+				binder_obj_lock_release();
 				break;
 			}
 			switch (cmd) {
@@ -1898,6 +2136,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     debug_string, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak,
 				     ref->node->debug_id);
+			binder_obj_lock_release();
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1912,6 +2151,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_obj_lock_acquire();
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
 				binder_user_error("binder: %d:%d "
@@ -1921,6 +2161,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" :
 					"BC_ACQUIRE_DONE",
 					node_ptr);
+				binder_obj_lock_release();
 				break;
 			}
 			if (cookie != node->cookie) {
@@ -1931,6 +2172,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_obj_lock_release();
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1940,6 +2182,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_obj_lock_release();
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1950,6 +2193,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_obj_lock_release();
 					break;
 				}
 				node->pending_weak_ref = 0;
@@ -1962,6 +2206,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 							: "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs,
 							node->local_weak_refs);
+			binder_obj_lock_release();
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1981,20 +2226,24 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_mutex_lock(&proc->alloc_lock, BINDER_LOCK_ALLOC);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			binder_obj_lock_acquire();
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found"
 				     " buffer %d for %s transaction\n",
@@ -2014,7 +2263,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			binder_obj_lock_release();
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
 			break;
 		}
 
@@ -2033,6 +2284,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_obj_lock_acquire();
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2050,6 +2302,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_obj_lock_release();
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
@@ -2084,6 +2337,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_obj_lock_acquire();
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
@@ -2093,6 +2347,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_REQUEST_DEATH_NOTIFICATION" :
 					"BC_CLEAR_DEATH_NOTIFICATION",
 					target);
+				binder_obj_lock_release();
 				break;
 			}
 
@@ -2114,6 +2369,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					binder_obj_lock_release();
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
@@ -2125,6 +2381,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"BC_REQUEST_DEATH_NOTIFICATION"
 						" failed\n",
 						proc->pid, thread->pid);
+					binder_obj_lock_release();
 					break;
 				}
 				binder_stats_created(BINDER_STAT_DEATH);
@@ -2147,6 +2404,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_obj_lock_release();
 					break;
 				}
 				death = ref->death;
@@ -2158,6 +2416,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_obj_lock_release();
 					break;
 				}
 				ref->death = NULL;
@@ -2174,6 +2433,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
 			}
+			binder_obj_lock_release();
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2183,6 +2443,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_obj_lock_acquire();
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2197,6 +2458,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
+				binder_obj_lock_release();
 				break;
 			}
 
@@ -2210,6 +2472,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			binder_obj_lock_release();
 		} break;
 
 		default:
@@ -2227,9 +2490,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2246,6 +2509,70 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+static void binder_record_latency(struct binder_proc *proc,
+				  struct binder_transaction *t, bool reply)
+{
+	ktime_t now = ktime_get();
+	s64 latency_us = ktime_us_delta(now, t->queued);
+	s64 roundtrip_us = 0;
+	int b;
+
+	b = binder_latency_bucket(latency_us);
+	proc->latency.delivery[b]++;
+	binder_latency.delivery[b]++;
+	if (reply) {
+		roundtrip_us = ktime_us_delta(now, t->call_start);
+		b = binder_latency_bucket(roundtrip_us);
+		proc->latency.roundtrip[b]++;
+		binder_latency.roundtrip[b]++;
+	}
+	trace_binder_transaction_received(t, reply, latency_us, roundtrip_us);
+}
+
+/*
+ * binder_thread_read() builds each return command in a kernel buffer
+ * under binder_obj_lock and copies it to userspace with the lock
+ * dropped, so that a fault on the read buffer never stalls other procs.
+ */
+static inline void binder_put_out(char *out, size_t *out_size,
+				  const void *data, size_t size)
+{
+	memcpy(out + *out_size, data, size);
+	*out_size += size;
+}
+
+static int binder_copy_out_unlocked(void __user **ptr, const char *out,
+				    size_t out_size)
+{
+	int ret = 0;
+
+	binder_obj_lock_release();
+	if (copy_to_user(*ptr, out, out_size))
+		ret = -EFAULT;
+	else
+		*ptr += out_size;
+	binder_obj_lock_acquire();
+	return ret;
+}
+
+/*
+ * Copy the command for work item @w out, once the caller has taken @w
+ * off @list. The work is only consumed if the copy succeeds: on a fault
+ * it goes back to the head of @list to be delivered by the next read.
+ */
+static int binder_copy_work_out(struct binder_proc *proc, void __user **ptr,
+				const char *out, size_t out_size,
+				struct binder_work *w, struct list_head *list)
+{
+	if (!binder_copy_out_unlocked(ptr, out, out_size))
+		return 0;
+
+	list_add(&w->entry, list);
+	if (list == &proc->todo)
+		wake_up_interruptible(&proc->wait);
+	return -EFAULT;
+}
+
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2253,9 +2580,12 @@ static int binder_thread_read(struct binder_proc *proc,
 {
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	char out[sizeof(uint32_t) + sizeof(struct binder_transaction_data)];
+	size_t out_size;
 
 	int ret = 0;
 	int wait_for_proc_work;
+	int spawn_looper = 0;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2263,23 +2593,26 @@ static int binder_thread_read(struct binder_proc *proc,
 		ptr += sizeof(uint32_t);
 	}
 
+	binder_obj_lock_acquire();
 retry:
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		out_size = 0;
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
+			binder_put_out(out, &out_size, &thread->return_error2,
+				       sizeof(uint32_t));
+			if (ptr + out_size != end)
+				thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
+		if (ptr + out_size != end) {
+			binder_put_out(out, &out_size, &thread->return_error,
+				       sizeof(uint32_t));
+			thread->return_error = BR_OK;
+		}
+		if (binder_copy_out_unlocked(&ptr, out, out_size))
+			goto err_fault;
 		goto done;
 	}
 
@@ -2287,7 +2620,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_obj_lock_release();
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2311,29 +2645,35 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	trace_binder_wakeup(thread, wait_for_proc_work, ret);
+	binder_main_lock_read();
+	binder_obj_lock_acquire();
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
-	if (ret)
+	if (ret) {
+		binder_obj_lock_release();
 		return ret;
+	}
 
 	while (1) {
 		uint32_t cmd;
 		struct binder_transaction_data tr;
 		struct binder_work *w;
+		struct list_head *list;
 		struct binder_transaction *t = NULL;
 
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
+		w = list_first_entry(list, struct binder_work, entry);
 
 		if (end - ptr < sizeof(tr) + 4)
 			break;
@@ -2344,16 +2684,19 @@ retry:
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
+			out_size = 0;
+			binder_put_out(out, &out_size, &cmd, sizeof(cmd));
+
+			list_del(&w->entry);
+			if (binder_copy_work_out(proc, &ptr, out, out_size,
+						 w, list))
+				goto err_fault;
 
 			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
 
-			list_del(&w->entry);
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
@@ -2385,20 +2728,21 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
+				out_size = 0;
+				binder_put_out(out, &out_size, &cmd, sizeof(cmd));
+				binder_put_out(out, &out_size, &node->ptr,
+					       sizeof(void *));
+				binder_put_out(out, &out_size, &node->cookie,
+					       sizeof(void *));
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
 					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+
+				if (binder_copy_out_unlocked(&ptr, out,
+							     out_size))
+					goto err_fault;
 			} else {
 				list_del_init(&w->entry);
 				if (!weak && !strong) {
@@ -2428,12 +2772,10 @@ retry:
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
+			out_size = 0;
+			binder_put_out(out, &out_size, &cmd, sizeof(cmd));
+			binder_put_out(out, &out_size, &death->cookie,
+				       sizeof(void *));
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
 				      proc->pid, thread->pid,
@@ -2443,11 +2785,39 @@ retry:
 				      death->cookie);
 
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				/* The ref no longer points to it, only we do */
 				list_del(&w->entry);
+				if (binder_copy_work_out(proc, &ptr, out,
+							 out_size, w, list))
+					goto err_fault;
 				kfree(death);
 				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
+			} else {
+				struct binder_work *tmp;
+
+				/*
+				 * It has to stay on a list while the lock is
+				 * dropped, BC_CLEAR_DEATH_NOTIFICATION tells
+				 * queued from idle notifications that way.
+				 */
 				list_move(&w->entry, &proc->delivered_death);
+				if (binder_copy_out_unlocked(&ptr, out,
+							     out_size)) {
+					/* unless BC_DEAD_BINDER_DONE took it */
+					list_for_each_entry(tmp,
+						&proc->delivered_death, entry) {
+						if (tmp == w) {
+							list_move(&w->entry,
+								  list);
+							break;
+						}
+					}
+					if (list == &proc->todo)
+						wake_up_interruptible(
+							&proc->wait);
+					goto err_fault;
+				}
+			}
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
@@ -2494,14 +2864,22 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
+		out_size = 0;
+		binder_put_out(out, &out_size, &cmd, sizeof(cmd));
+		binder_put_out(out, &out_size, &tr, sizeof(tr));
+
+		/*
+		 * Claim the transaction, but only consume it once userspace
+		 * has it: a two-way one that was pushed on our stack but never
+		 * delivered would leave its caller waiting forever.
+		 */
+		list_del(&t->work.entry);
+		if (binder_copy_work_out(proc, &ptr, out, out_size,
+					 &t->work, list))
+			goto err_fault;
 
 		binder_stat_br(proc, thread, cmd);
+		binder_record_latency(proc, t, cmd == BR_REPLY);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2513,7 +2891,6 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
@@ -2539,10 +2916,18 @@ done:
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
-		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
-			return -EFAULT;
+		spawn_looper = 1;
 	}
+	binder_obj_lock_release();
+
+	if (spawn_looper &&
+	    put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
+		return -EFAULT;
 	return 0;
+
+err_fault:
+	binder_obj_lock_release();
+	return -EFAULT;
 }
 
 static void binder_release_work(struct list_head *list)
@@ -2574,8 +2959,10 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
-	struct rb_node **p = &proc->threads.rb_node;
+	struct rb_node **p;
 
+	binder_mutex_lock(&proc->lock, BINDER_LOCK_PROC);
+	p = &proc->threads.rb_node;
 	while (*p) {
 		parent = *p;
 		thread = rb_entry(parent, struct binder_thread, rb_node);
@@ -2590,7 +2977,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	if (*p == NULL) {
 		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
 		if (thread == NULL)
-			return NULL;
+			goto out;
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
@@ -2602,6 +2989,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->return_error = BR_OK;
 		thread->return_error2 = BR_OK;
 	}
+out:
+	mutex_unlock(&proc->lock);
 	return thread;
 }
 
@@ -2653,12 +3042,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_main_lock_read();
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		up_read(&binder_main_lock);
+		return POLLERR;
+	}
 
+	binder_obj_lock_acquire();
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_obj_lock_release();
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2683,6 +3078,8 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
+	int exclusive = (cmd == BINDER_SET_CONTEXT_MGR ||
+			 cmd == BINDER_THREAD_EXIT);
 
 	/*binder_debug(BINDER_DEBUG_TOP_ERRORS, "binder_ioctl: %d:%d %x %lx\n",
 					proc->pid, current->pid, cmd, arg);*/
@@ -2692,7 +3089,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	if (exclusive)
+		binder_main_lock_write();
+	else
+		binder_main_lock_read();
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2726,8 +3126,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			trace_binder_read_done(thread, ret);
+			binder_obj_lock_acquire();
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			binder_obj_lock_release();
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2744,13 +3147,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf,
-					sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_obj_lock_acquire();
+		proc->max_threads = max_threads;
+		binder_obj_lock_release();
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
 		if (binder_context_mgr_node != NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2804,7 +3212,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	if (exclusive)
+		up_write(&binder_main_lock);
+	else
+		up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2848,6 +3259,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2897,6 +3309,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+	INIT_LIST_HEAD(&proc->page_pool);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2948,16 +3363,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->lock);
+	mutex_init(&proc->alloc_lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	binder_main_lock_write();
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_main_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3102,7 +3519,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
@@ -3111,7 +3528,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					     page_addr);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
@@ -3138,7 +3555,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3165,7 +3582,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3418,17 +3835,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3436,12 +3857,40 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
+
+	if (atomic_read(&stats->page_pool_hits) ||
+	    atomic_read(&stats->page_pool_misses))
+		seq_printf(m, "%spage pool: hits %d misses %d\n", prefix,
+			   atomic_read(&stats->page_pool_hits),
+			   atomic_read(&stats->page_pool_misses));
+}
+
+static const char *binder_lock_strings[] = {
+	"main",
+	"proc",
+	"alloc",
+	"obj"
+};
+
+static void print_binder_lock_stats(struct seq_file *m)
+{
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_lock_stats.acquired) !=
+		     ARRAY_SIZE(binder_lock_strings));
+	for (i = 0; i < ARRAY_SIZE(binder_lock_stats.acquired); i++)
+		seq_printf(m, "lock %s: acquired %d contended %d\n",
+			   binder_lock_strings[i],
+			   atomic_read(&binder_lock_stats.acquired[i]),
+			   atomic_read(&binder_lock_stats.contended[i]));
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3481,6 +3930,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  pooled pages: %d\n", proc->page_pool_count);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3506,7 +3956,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder state:\n");
 
@@ -3518,7 +3968,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3529,16 +3979,17 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	print_binder_lock_stats(m);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3549,13 +4000,57 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
+	return 0;
+}
+
+static void print_binder_latency_hist(struct seq_file *m, const char *prefix,
+				      const char *name, u32 *hist)
+{
+	int i;
+
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == 0)
+			seq_printf(m, "%s%s <1us: %u\n", prefix, name, hist[i]);
+		else if (i == BINDER_LATENCY_BUCKETS - 1)
+			seq_printf(m, "%s%s >=%luus: %u\n", prefix, name,
+				   1UL << (i - 1), hist[i]);
+		else
+			seq_printf(m, "%s%s %lu-%luus: %u\n", prefix, name,
+				   1UL << (i - 1), (1UL << i) - 1, hist[i]);
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		binder_main_lock_write();
+
+	seq_puts(m, "binder latency:\n");
+	print_binder_latency_hist(m, "", "delivery", binder_latency.delivery);
+	print_binder_latency_hist(m, "", "roundtrip", binder_latency.roundtrip);
+
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		seq_printf(m, "proc %d\n", proc->pid);
+		print_binder_latency_hist(m, "  ", "delivery",
+					  proc->latency.delivery);
+		print_binder_latency_hist(m, "  ", "roundtrip",
+					  proc->latency.roundtrip);
+	}
+	if (do_lock)
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3565,11 +4060,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3618,6 +4113,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3658,6 +4154,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
@@ -0,0 +1,138 @@
+/* binder_trace.h
+ *
+ * Android IPC Subsystem tracepoints
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_transaction;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+
+/*
+ * A transaction or reply has been queued on the target's todo list and
+ * the target has been woken up (unless it is an async transaction that
+ * has to wait behind another one for the same node).
+ */
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node, bool wakeup),
+	TP_ARGS(reply, t, target_node, wakeup),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+		__field(int, wakeup)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+		__entry->wakeup = wakeup;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x wakeup=%d",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code,
+		  __entry->wakeup)
+);
+
+/* A thread that was sleeping in binder_thread_read woke up. */
+TRACE_EVENT(binder_wakeup,
+	TP_PROTO(struct binder_thread *thread, bool proc_work, int ret),
+	TP_ARGS(thread, proc_work, ret),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, proc_work)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->proc = thread->proc->pid;
+		__entry->thread = thread->pid;
+		__entry->proc_work = proc_work;
+		__entry->ret = ret;
+	),
+	TP_printk("proc=%d thread=%d proc_work=%d ret=%d",
+		  __entry->proc, __entry->thread, __entry->proc_work,
+		  __entry->ret)
+);
+
+/*
+ * A transaction (BR_TRANSACTION) or reply (BR_REPLY) has been copied to
+ * the reading thread.  latency_us is the time it spent queued; for a
+ * reply, roundtrip_us is the time since the call it answers was sent.
+ */
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, bool reply,
+		 s64 latency_us, s64 roundtrip_us),
+	TP_ARGS(t, reply, latency_us, roundtrip_us),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply)
+		__field(s64, latency_us)
+		__field(s64, roundtrip_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->reply = reply;
+		__entry->latency_us = latency_us;
+		__entry->roundtrip_us = roundtrip_us;
+	),
+	TP_printk("transaction=%d reply=%d latency=%lldus roundtrip=%lldus",
+		  __entry->debug_id, __entry->reply,
+		  (long long)__entry->latency_us,
+		  (long long)__entry->roundtrip_us)
+);
+
+/* binder_thread_read is about to return to user space. */
+TRACE_EVENT(binder_read_done,
+	TP_PROTO(struct binder_thread *thread, int ret),
+	TP_ARGS(thread, ret),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->proc = thread->proc->pid;
+		__entry->thread = thread->pid;
+		__entry->ret = ret;
+	),
+	TP_printk("proc=%d thread=%d ret=%d",
+		  __entry->proc, __entry->thread, __entry->ret)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -24,9 +24,11 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/time.h>
 #include "logger.h"
 
+#include <asm/io.h>
 #include <asm/ioctls.h>
 
 static unsigned long platform_reset_count;
@@ -310,17 +312,24 @@ void gaf_helper(void)
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * The log is written without a lock. The offsets in 'hdr' are free-running
+ * byte positions that are only reduced modulo 'size' (logger_offset) when
+ * indexing the buffer. A writer claims room by advancing 'reserve' with
+ * cmpxchg, pulls 'head' forward past every entry the claim will overwrite,
+ * copies its entry in and then publishes it by advancing 'w_off'. Entries
+ * are published in the order they were reserved, so everything before
+ * 'w_off' is complete.
+ *
+ * 'hdr' lives in its own page so that it can be mapped read-only into
+ * readers together with the buffer, see logger_mmap().
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_mmap_header *hdr;	/* reserve, w_off and head */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -328,17 +337,25 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'. A reader whose
+ * 'r_off' has fallen behind the log's 'head' has been lapped by the writers
+ * and resumes at 'head'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads on this file */
+	__u32			r_off;	/* current read head position */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * Entries up to this size are assembled on the writer's stack; larger ones
+ * go through a kmalloc'd bounce buffer.
+ */
+#define LOGGER_STACK_BUF_LEN	256
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -364,14 +381,16 @@ static inline struct logger_log *file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from position 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The result is only meaningful if 'off' has not been lapped, which the
+ * caller must check afterwards with logger_lapped().
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, __u32 off)
 {
 	__u16 val;
 
+	off = logger_offset(off);
 	switch (log->size - off) {
 	case 1:
 		memcpy(&val, log->buffer + off, 1);
@@ -384,17 +403,47 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * logger_lapped - has the entry at position 'off' been (or is it about to
+ * be) overwritten? Call after reading from the buffer: writers move 'head'
+ * past an entry before they start overwriting it.
+ */
+static inline int logger_lapped(struct logger_log *log, __u32 off)
+{
+	smp_rmb();
+	return (__s32)(off - ACCESS_ONCE(log->hdr->head)) < 0;
+}
+
+/*
+ * logger_fix_up_reader - move a reader that was lapped to the oldest entry
+ * still in the log.
+ *
+ * Caller must hold reader->mutex.
+ */
+static void logger_fix_up_reader(struct logger_log *log,
+				 struct logger_reader *reader)
+{
+	__u32 head = ACCESS_ONCE(log->hdr->head);
+
+	if ((__s32)(reader->r_off - head) < 0)
+		reader->r_off = head;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Does not advance the reader: the caller must first check that the data
+ * was not overwritten while it was being copied.
+ *
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -402,8 +451,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -414,8 +463,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -443,9 +490,7 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = (ACCESS_ONCE(log->hdr->w_off) == ACCESS_ONCE(reader->r_off));
 		if (!ret)
 			break;
 
@@ -466,16 +511,22 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+
+retry:
+	logger_fix_up_reader(log, reader);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(ACCESS_ONCE(log->hdr->w_off) == reader->r_off)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
+	smp_rmb();
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
+	if (logger_lapped(log, reader->r_off))
+		goto retry;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
@@ -483,133 +534,97 @@ start:
 
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	/* a writer lapped us while we were copying, the entry is torn */
+	if (logger_lapped(log, reader->r_off))
+		goto retry;
+
+	reader->r_off += ret;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_reserve - claim 'len' bytes at the end of the log and return the
+ * position of the claimed region.
+ *
+ * Before returning, 'head' is pulled forward to the first entry that the
+ * claim does not overwrite, so that readers can tell that they were lapped.
+ * Concurrent writers may race to advance 'head'; the cmpxchg makes sure a
+ * length read from an entry that was already overwritten is never used.
  *
- * Caller must hold log->mutex.
+ * Caller must have preemption disabled until logger_commit().
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static __u32 logger_reserve(struct logger_log *log, size_t len)
 {
-	size_t count = 0;
+	__u32 start, head;
 
 	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+		start = ACCESS_ONCE(log->hdr->reserve);
+	} while (cmpxchg(&log->hdr->reserve, start, start + len) != start);
 
-	return off;
-}
+	while (head = ACCESS_ONCE(log->hdr->head), start + len - head > log->size) {
+		__u32 nr;
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+		smp_rmb();
+		nr = get_entry_len(log, head);
+		cmpxchg(&log->hdr->head, head, head + nr);
 	}
 
-	return 0;
-}
+	/* readers must see the new head before any of the new data */
+	smp_mb();
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
-
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return start;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_commit - publish the entry of 'len' bytes reserved at 'start'.
  *
- * The caller needs to hold log->mutex.
+ * Entries are published in reservation order. Writers only spin here on
+ * writers with earlier reservations that are still copying their entry in,
+ * and those run with preemption disabled.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_commit(struct logger_log *log, __u32 start,
+			  size_t len)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
+	while (ACCESS_ONCE(log->hdr->w_off) != start)
+		cpu_relax();
 
+	smp_wmb();
+	log->hdr->w_off = start + len;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at position 'start'
  *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * The caller must have reserved the region with logger_reserve().
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void do_write_log(struct logger_log *log, __u32 start,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(start);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
-
-#ifdef CONFIG_APPLY_GA_SOLUTION
-// @message
-	memset(klog_buf,0,255);
-	if(strncmp(log->buffer + log->w_off, "!@", 2) == 0) {
-		if (count < 255)
-			memcpy(klog_buf,log->buffer + log->w_off, count);
-		else
-			memcpy(klog_buf,log->buffer + log->w_off, 255);
-
-		klog_buf[255]=0;
-	}
-#endif
-
-	log->w_off = logger_offset(log->w_off + count);
-
-	return count;
+		memcpy(log->buffer, buf + len, count - len);
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is first assembled in a bounce buffer, since copying from user
+ * space may fault; only the copy into the ring happens between reserving
+ * and publishing the entry.
  */
 /* cpu currently holding logbuf_lock */
 #ifdef ADD_SYSTEM_TIMEINFO
@@ -619,9 +634,15 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	union {
+		struct logger_entry entry;
+		char buf[LOGGER_STACK_BUF_LEN];
+	} stack_buf;
 	struct logger_entry header;
+	struct logger_entry *entry;
 	struct timespec now;
+	__u32 start;
+	size_t entry_len;
 	ssize_t ret = 0;
 
 #ifdef ADD_SYSTEM_TIMEINFO
@@ -656,41 +677,55 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry_len = sizeof(struct logger_entry) + header.len;
+	if (entry_len <= sizeof(stack_buf))
+		entry = &stack_buf.entry;
+	else {
+		entry = kmalloc(entry_len, GFP_KERNEL);
+		if (unlikely(!entry))
+			return -ENOMEM;
+	}
+	memcpy(entry, &header, sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
-		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		/* copy in this segment's payload */
+		if (len && copy_from_user(entry->msg + ret, iov->iov_base, len)) {
+			ret = -EFAULT;
+			goto out;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
 
-	mutex_unlock(&log->mutex);
+#ifdef CONFIG_APPLY_GA_SOLUTION
+// @message
+	memset(klog_buf,0,255);
+	if(strncmp(entry->msg, "!@", 2) == 0) {
+		if (header.len < 255)
+			memcpy(klog_buf,entry->msg, header.len);
+		else
+			memcpy(klog_buf,entry->msg, 255);
+
+		klog_buf[255]=0;
+	}
+#endif
+
+	preempt_disable();
+	start = logger_reserve(log, entry_len);
+	do_write_log(log, start, entry, entry_len);
+	logger_commit(log, start, entry_len);
+	preempt_enable();
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 #ifdef CONFIG_APPLY_GA_SOLUTION
 // @message
@@ -700,6 +735,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	}
 #endif
 
+out:
+	if (entry != &stack_buf.entry)
+		kfree(entry);
+
 	return ret;
 }
 
@@ -736,12 +775,8 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_off = ACCESS_ONCE(log->hdr->head);
 
 		file->private_data = reader;
 	} else
@@ -759,10 +794,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -792,10 +823,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (ACCESS_ONCE(log->hdr->w_off) != ACCESS_ONCE(reader->r_off))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -804,10 +833,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	__u32 head;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -818,10 +846,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		logger_fix_up_reader(log, reader);
+		ret = ACCESS_ONCE(log->hdr->w_off) - reader->r_off;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -829,31 +857,89 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		mutex_lock(&reader->mutex);
+		do {
+			logger_fix_up_reader(log, reader);
+			if (ACCESS_ONCE(log->hdr->w_off) == reader->r_off) {
+				ret = 0;
+				break;
+			}
+			smp_rmb();
 			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		} while (logger_lapped(log, reader->r_off));
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_READ_POS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		if ((__s32)((__u32)arg - ACCESS_ONCE(log->hdr->w_off)) > 0) {
+			ret = -EINVAL;
+			break;
+		}
+		mutex_lock(&reader->mutex);
+		reader->r_off = arg;
+		logger_fix_up_reader(log, reader);
+		mutex_unlock(&reader->mutex);
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers behind the new head will skip forward on their own */
+		do {
+			head = ACCESS_ONCE(log->hdr->head);
+		} while (cmpxchg(&log->hdr->head, head, ACCESS_ONCE(log->hdr->w_off)) != head);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the page holding the log's struct logger_mmap_header, followed by the
+ * ring buffer itself, read-only into a reader. The reader can then consume
+ * entries in place: see the comment above struct logger_mmap_header.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	log = file_get_log(file);
+
+	if (vma->vm_pgoff != 0 || len > PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->hdr) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret || len == PAGE_SIZE)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       len - PAGE_SIZE, vma->vm_page_prot);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
+	.mmap = logger_mmap,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
@@ -868,9 +954,20 @@ static const struct file_operations logger_fops = {
  * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
+static union { \
+	struct logger_mmap_header hdr; \
+	unsigned char page[PAGE_SIZE]; \
+} _hdr_ ## VAR __aligned(PAGE_SIZE) = { \
+	.hdr = { \
+		.version = LOGGER_MMAP_VERSION, \
+		.size = SIZE, \
+		.data_offset = PAGE_SIZE, \
+	}, \
+}; \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
+	.hdr = &_hdr_ ## VAR .hdr, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -878,10 +975,6 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
 };
 
@@ -36,6 +36,34 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - the first page of an mmap() of a log device
+ *
+ * The ring buffer follows at 'data_offset'. The three positions are
+ * free-running byte counts; the entry at position 'pos' starts at byte
+ * (pos & (size - 1)) of the ring and may wrap around its end.
+ *
+ * A reader keeps its own position 'pos', starting at 'head':
+ *
+ *	- entries in [pos, w_off) are complete (read w_off, then a read barrier,
+ *	  then the entries)
+ *	- after copying or parsing an entry, issue a read barrier and re-read
+ *	  'head': if (__s32)(pos - head) < 0 the entry may have been overwritten
+ *	  while it was being read, so discard it and continue from 'head'
+ *	- after consuming up to 'w_off', pass it to LOGGER_SET_READ_POS before
+ *	  sleeping in poll(), which reports POLLIN once 'w_off' moves past it
+ */
+struct logger_mmap_header {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		size;		/* size of the ring, a power of two */
+	__u32		data_offset;	/* offset of the ring in the mapping */
+	__u32		reserve;	/* writers have claimed up to here */
+	__u32		w_off;		/* entries before this are complete */
+	__u32		head;		/* oldest entry still in the ring */
+};
+
+#define LOGGER_MMAP_VERSION		1
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -56,6 +84,7 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_POS		_IO(__LOGGERIO, 5) /* mmap reader pos */
 
 void dump_one_task_info(struct task_struct *tsk, bool isMain);
 void dump_all_task_info();
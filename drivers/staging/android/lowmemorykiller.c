@@ -16,6 +16,12 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Writing 1 to /sys/module/lowmemorykiller/parameters/async hands the killing
+ * over to a kernel thread that also looks at how fast free memory is falling
+ * and how well reclaim is doing, and kills ahead of demand (kill_ahead_ms)
+ * when reclaim cannot keep up. Its counters (kill_count, kill_latency_ms,
+ * freed_pages, ...) are exported next to the other parameters.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +41,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/profile.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/vmstat.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +67,43 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * In async mode the shrinker only wakes up a dedicated killer thread, which
+ * watches free memory trends and reclaim efficiency, may kill ahead of
+ * demand, and after each kill waits for the victim's memory to actually be
+ * freed instead of backing off for a fixed time.
+ */
+static int lowmem_async;
+static unsigned int lowmem_poll_ms = 100;
+static unsigned int lowmem_kill_ahead_ms = 500;
+static unsigned int lowmem_reclaim_efficiency = 50;	/* percent */
+static unsigned int lowmem_deathpending_timeout_ms = 1000;
+
+static struct task_struct *lowmem_killer;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_killer_wait);
+static int lowmem_killer_wakeup;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_victim_wait);
+
+static unsigned int lowmem_kill_count;
+static unsigned int lowmem_kill_ahead_count;
+static unsigned int lowmem_kill_timeout_count;
+static unsigned int lowmem_kill_latency_ms;
+static unsigned int lowmem_kill_latency_max_ms;
+static unsigned long lowmem_freed_pages;
+static unsigned int lowmem_reclaim_efficiency_last = 100;
+
+/*
+ * Thread group leaders, bucketed by oom_adj, so that victim selection only
+ * has to look at the tasks in the highest populated bucket at or above the
+ * minimum oom_adj, instead of walking the whole task list. Tasks are filed
+ * from the oom_adj notifier (fork, exec and /proc/<pid>/oom_adj writes) and
+ * removed again from the task exit profile notifier.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_index[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -75,21 +124,151 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
+	if (waitqueue_active(&lowmem_victim_wait))
+		wake_up(&lowmem_victim_wait);
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+static int
+lowmem_oom_adj_notify(struct notifier_block *self, unsigned long val,
+		      void *data)
+{
+	struct task_struct *task = data;
+	int oom_adj;
+
+	/* oom_adj is per process, so is the index: file the leader */
+	task = task->group_leader;
+
+	oom_adj = clamp_t(int, task->signal->oom_adj, OOM_DISABLE,
+			  OOM_ADJUST_MAX);
+
+	spin_lock(&lowmem_index_lock);
+	/* an exiting task leaves its node poisoned, don't file it again */
+	if (task->lowmem_node.next != LIST_POISON1)
+		list_move_tail(&task->lowmem_node,
+			       &lowmem_index[oom_adj - OOM_DISABLE]);
+	spin_unlock(&lowmem_index_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_oom_adj_nb = {
+	.notifier_call	= lowmem_oom_adj_notify,
+};
+
+static int
+lowmem_task_exit_notify(struct notifier_block *self, unsigned long val,
+			void *data)
+{
+	struct task_struct *task = data;
+
+	/* list_del() poisons the node, see lowmem_oom_adj_notify() */
+	spin_lock(&lowmem_index_lock);
+	list_del(&task->lowmem_node);
+	spin_unlock(&lowmem_index_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_task_exit_nb = {
+	.notifier_call	= lowmem_task_exit_notify,
+};
+
+static void lowmem_wake_killer(void)
+{
+	lowmem_killer_wakeup = 1;
+	wake_up_interruptible(&lowmem_killer_wait);
+}
+
+/*
+ * lowmem_min_adj - the minimum oom_adj to kill at for the given amount of
+ * free and file-backed memory, or OOM_ADJUST_MAX + 1 if nothing needs to
+ * be killed.
+ */
+static int lowmem_min_adj(int other_free, int other_file)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
+	}
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * lowmem_select - pick the task with the highest oom_adj at or above
+ * 'min_adj', and the largest RSS among those.
+ *
+ * Caller must hold lowmem_index_lock, which keeps the returned task from
+ * exiting past the task exit notifier.
+ */
+static struct task_struct *
+lowmem_select(int min_adj, int *selected_tasksize, int *selected_oom_adj)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
+	int adj;
+
+	*selected_oom_adj = min_adj;
+	*selected_tasksize = 0;
+
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, &lowmem_index[adj - OOM_DISABLE],
+				    lowmem_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
+				continue;
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < *selected_oom_adj)
+					continue;
+				if (oom_adj == *selected_oom_adj &&
+				    tasksize <= *selected_tasksize)
+					continue;
+			}
+			selected = p;
+			*selected_tasksize = tasksize;
+			*selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+	}
+	return selected;
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	int rem = 0;
+	int min_adj;
+	int selected_tasksize;
 	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int async = lowmem_async && lowmem_killer;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -101,21 +280,11 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	 * this pass.
 	 *
 	 */
-	if (lowmem_deathpending &&
+	if (!async && lowmem_deathpending &&
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
-	}
+	min_adj = lowmem_min_adj(other_free, other_file);
 	if (min_adj == OOM_ADJUST_MAX + 1)
 		return 0;
 		
@@ -133,44 +302,16 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	/* in async mode the killer thread does the work */
+	if (async) {
+		lowmem_wake_killer();
+		return -1;
 	}
+
+	spin_lock(&lowmem_index_lock);
+	selected = lowmem_select(min_adj, &selected_tasksize,
+				 &selected_oom_adj);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -183,7 +324,7 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		rem = -1;
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
+	spin_unlock(&lowmem_index_lock);
 	return rem;
 }
 
@@ -192,9 +333,215 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+/*
+ * lowmem_reclaim_stat - total pages scanned and reclaimed by kswapd and
+ * direct reclaim so far. Both stay zero without CONFIG_VM_EVENT_COUNTERS.
+ */
+static void lowmem_reclaim_stat(unsigned long *scanned, unsigned long *stolen)
+{
+	unsigned long events[NR_VM_EVENT_ITEMS];
+	int z;
+
+	memset(events, 0, sizeof(events));
+	all_vm_events(events);
+
+	*scanned = *stolen = 0;
+	for (z = 0; z < MAX_NR_ZONES; z++) {
+		*scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + z] +
+			    events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + z];
+		*stolen += events[PGSTEAL_NORMAL - ZONE_NORMAL + z];
+	}
+}
+
+/*
+ * lowmem_kill - kill the best victim at or above 'min_adj' and wait until
+ * its memory has actually been released, or lowmem_deathpending_timeout
+ * ms have passed. Returns 0 if there was nothing to kill.
+ */
+static int lowmem_kill(int min_adj, int ahead)
+{
+	struct task_struct *selected;
+	struct mm_struct *mm = NULL;
+	int selected_tasksize;
+	int selected_oom_adj;
+	unsigned long start;
+	unsigned int latency;
+	long left;
+
+	spin_lock(&lowmem_index_lock);
+	selected = lowmem_select(min_adj, &selected_tasksize,
+				 &selected_oom_adj);
+	if (selected) {
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d%s\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize,
+			     ahead ? " (ahead)" : "");
+		task_lock(selected);
+		mm = selected->mm;
+		if (mm)
+			atomic_inc(&mm->mm_count);
+		task_unlock(selected);
+		force_sig(SIGKILL, selected);
+	}
+	spin_unlock(&lowmem_index_lock);
+
+	if (!selected)
+		return 0;
+
+	lowmem_kill_count++;
+	if (ahead)
+		lowmem_kill_ahead_count++;
+	if (!mm)
+		return 1;
+
+	/* woken from the task free notifier once the victim is gone */
+	start = jiffies;
+	left = wait_event_timeout(lowmem_victim_wait,
+				  atomic_read(&mm->mm_users) == 0,
+				  msecs_to_jiffies(lowmem_deathpending_timeout_ms));
+	latency = jiffies_to_msecs(jiffies - start);
+	if (left) {
+		lowmem_freed_pages += selected_tasksize;
+		lowmem_kill_latency_ms = latency;
+		if (latency > lowmem_kill_latency_max_ms)
+			lowmem_kill_latency_max_ms = latency;
+	} else
+		lowmem_kill_timeout_count++;
+	mmdrop(mm);
+
+	return 1;
+}
+
+/*
+ * lowmem_scan - one pass of the killer thread
+ *
+ * Besides the current free and file page counts, this tracks how fast they
+ * are falling and how much of what reclaim scans it manages to free. When
+ * reclaim is not keeping up (efficiency below lowmem_reclaim_efficiency
+ * percent) the thresholds are applied to the counts projected
+ * lowmem_kill_ahead_ms into the future, so that we kill before allocations
+ * start stalling rather than after.
+ *
+ * Returns 1 if memory is low enough that we should keep polling.
+ */
+static int lowmem_scan(void)
+{
+	static unsigned long last_sample;
+	static int last_free, last_file;
+	static unsigned long last_scanned, last_stolen;
+	static int trend_free, trend_file;	/* pages per second */
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+	unsigned long scanned, stolen;
+	unsigned int efficiency = 100;
+	unsigned int elapsed;
+	int min_adj, ahead_adj;
+	int proj_free = other_free, proj_file = other_file;
+
+	lowmem_reclaim_stat(&scanned, &stolen);
+	elapsed = jiffies_to_msecs(jiffies - last_sample);
+	if (last_sample && elapsed) {
+		int slope_free = (other_free - last_free) * 1000 / (int)elapsed;
+		int slope_file = (other_file - last_file) * 1000 / (int)elapsed;
+
+		trend_free = (trend_free * 3 + slope_free) / 4;
+		trend_file = (trend_file * 3 + slope_file) / 4;
+		if (scanned != last_scanned)
+			efficiency = (stolen - last_stolen) * 100 /
+				     (scanned - last_scanned);
+	}
+	last_sample = jiffies;
+	last_free = other_free;
+	last_file = other_file;
+	last_scanned = scanned;
+	last_stolen = stolen;
+	lowmem_reclaim_efficiency_last = efficiency;
+
+	min_adj = lowmem_min_adj(other_free, other_file);
+	ahead_adj = min_adj;
+	if (lowmem_kill_ahead_ms && efficiency < lowmem_reclaim_efficiency) {
+		if (trend_free < 0)
+			proj_free += trend_free *
+				     (int)lowmem_kill_ahead_ms / 1000;
+		if (trend_file < 0)
+			proj_file += trend_file *
+				     (int)lowmem_kill_ahead_ms / 1000;
+		ahead_adj = lowmem_min_adj(max(proj_free, 0),
+					   max(proj_file, 0));
+	}
+
+	lowmem_print(4, "lowmem_scan ofree %d %d, trend %d %d, eff %u, "
+		     "ma %d ahead %d\n", other_free, other_file, trend_free,
+		     trend_file, efficiency, min_adj, ahead_adj);
+
+	if (ahead_adj <= OOM_ADJUST_MAX &&
+	    lowmem_kill(ahead_adj, ahead_adj < min_adj)) {
+		/* look again right away, the victim's memory is back */
+		last_sample = 0;
+		return 1;
+	}
+
+	/* keep watching the trend while we are near the top threshold */
+	return lowmem_min_adj(other_free / 2, other_file / 2) <=
+		OOM_ADJUST_MAX;
+}
+
+static int lowmem_killer_thread(void *unused)
+{
+	int pressure = 0;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (pressure)
+			timeout = msecs_to_jiffies(lowmem_poll_ms);
+		wait_event_freezable_timeout(lowmem_killer_wait,
+					     lowmem_killer_wakeup ||
+					     kthread_should_stop(), timeout);
+		lowmem_killer_wakeup = 0;
+		if (lowmem_async)
+			pressure = lowmem_scan();
+		else
+			pressure = 0;
+	}
+	return 0;
+}
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_index[i]);
+
 	task_free_register(&task_nb);
+	profile_event_register(PROFILE_TASK_EXIT, &lowmem_task_exit_nb);
+	register_oom_adj_notifier(&lowmem_oom_adj_nb);
+
+	/*
+	 * file the processes that were forked before we registered, except
+	 * exiting ones, whose exit notification may already have run, and
+	 * kernel threads
+	 */
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		if ((p->flags & PF_EXITING) || p->exit_state || !p->mm)
+			continue;
+		lowmem_oom_adj_notify(&lowmem_oom_adj_nb, 0, p);
+	}
+	read_unlock(&tasklist_lock);
+
+	lowmem_killer = kthread_run(lowmem_killer_thread, NULL,
+				    "lowmemorykiller");
+	if (IS_ERR(lowmem_killer)) {
+		printk(KERN_ERR "lowmemorykiller: failed to start killer "
+		       "thread, async mode unavailable\n");
+		lowmem_killer = NULL;
+	}
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -202,6 +549,10 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_killer)
+		kthread_stop(lowmem_killer);
+	unregister_oom_adj_notifier(&lowmem_oom_adj_nb);
+	profile_event_unregister(PROFILE_TASK_EXIT, &lowmem_task_exit_nb);
 	task_free_unregister(&task_nb);
 }
 
@@ -212,8 +563,29 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
+/* async (killer thread) mode tunables */
+module_param_named(async, lowmem_async, bool, S_IRUGO | S_IWUSR);
+module_param_named(poll_ms, lowmem_poll_ms, uint, S_IRUGO | S_IWUSR);
+module_param_named(kill_ahead_ms, lowmem_kill_ahead_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(reclaim_efficiency, lowmem_reclaim_efficiency, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(deathpending_timeout_ms, lowmem_deathpending_timeout_ms,
+		   uint, S_IRUGO | S_IWUSR);
+
+/* async mode statistics */
+module_param_named(kill_count, lowmem_kill_count, uint, S_IRUGO);
+module_param_named(kill_ahead_count, lowmem_kill_ahead_count, uint, S_IRUGO);
+module_param_named(kill_timeout_count, lowmem_kill_timeout_count, uint,
+		   S_IRUGO);
+module_param_named(kill_latency_ms, lowmem_kill_latency_ms, uint, S_IRUGO);
+module_param_named(kill_latency_max_ms, lowmem_kill_latency_max_ms, uint,
+		   S_IRUGO);
+module_param_named(freed_pages, lowmem_freed_pages, ulong, S_IRUGO);
+module_param_named(reclaim_efficiency_last, lowmem_reclaim_efficiency_last,
+		   uint, S_IRUGO);
+
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
-
@@ -25,15 +25,23 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
+#include <linux/lzo.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct kmem_cache *zram_entry_cache;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
@@ -129,13 +137,218 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static void zram_stream_free(struct zram_stream *stream)
+{
+	if (!IS_ERR_OR_NULL(stream->tfm))
+		crypto_free_comp(stream->tfm);
+	free_pages((unsigned long)stream->buffer, 1);
+	kfree(stream);
+}
+
+static struct zram_stream *zram_stream_alloc(struct zram *zram)
+{
+	struct zram_stream *stream;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return NULL;
+
+	stream->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	/*
+	 * Allocate 2 pages: the compressed output can exceed
+	 * PAGE_SIZE for incompressible input.
+	 */
+	stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+	if (IS_ERR(stream->tfm) || !stream->buffer) {
+		zram_stream_free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+/*
+ * Take an idle stream, waiting for one if all are in use. A crypto tfm
+ * may keep per-request state (e.g. deflate's z_stream) and must not be
+ * shared.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *stream = NULL;
+	ktime_t start;
+
+	spin_lock(&zram->stream_lock);
+	if (likely(!list_empty(&zram->stream_idle)))
+		goto found;
+	spin_unlock(&zram->stream_lock);
+
+	start = ktime_get();
+	for (;;) {
+		wait_event(zram->stream_wait,
+			   !list_empty(&zram->stream_idle));
+		spin_lock(&zram->stream_lock);
+		if (!list_empty(&zram->stream_idle))
+			break;
+		spin_unlock(&zram->stream_lock);
+	}
+	zram_stat64_inc(zram, &zram->stats.stream_waits);
+	zram_stat64_add(zram, &zram->stats.stream_wait_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+found:
+	stream = list_first_entry(&zram->stream_idle,
+				  struct zram_stream, list);
+	list_del(&stream->list);
+	spin_unlock(&zram->stream_lock);
+
+	return stream;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *stream)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&stream->list, &zram->stream_idle);
+	spin_unlock(&zram->stream_lock);
+
+	if (waitqueue_active(&zram->stream_wait))
+		wake_up(&zram->stream_wait);
+}
+
+/*
+ * Take the decompression stream. Returns NULL for lzo, which
+ * zram_read_slot() decompresses without one.
+ */
+static struct zram_stream *zram_dstream_get(struct zram *zram)
+{
+	if (!zram->dstream)
+		return NULL;
+
+	mutex_lock(&zram->dstream_lock);
+	return zram->dstream;
+}
+
+static void zram_dstream_put(struct zram *zram, struct zram_stream *stream)
+{
+	if (stream)
+		mutex_unlock(&zram->dstream_lock);
+}
+
+/* Coarse per-slot access time, in seconds */
+static u32 zram_now(void)
+{
+	return div_u64(get_jiffies_64(), HZ);
+}
+
+/*
+ * Backing device blocks are allocated from a bitmap. Block 0 is never
+ * used, so that a written back slot's table entry is never NULL.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block = 1;
+
+	do {
+		block = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_blocks,
+					   block);
+		if (block >= zram->bd_nr_blocks)
+			return 0;
+	} while (test_and_set_bit(block, zram->bd_bitmap));
+
+	return block;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long block)
+{
+	WARN_ON(!test_and_clear_bit(block, zram->bd_bitmap));
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously read or write one page of the backing device. Must not
+ * be called from zram_make_request(): the bio would only be submitted
+ * once we return.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page *page,
+			unsigned long block)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_private = &done;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+static struct hlist_head *zram_hash_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & zram->hash_mask];
+}
+
+/*
+ * Look for an already stored object with the given compressed contents.
+ * Called with table_lock held.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram, u32 checksum,
+				unsigned char *src, unsigned int clen)
+{
+	struct zram_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos, zram_hash_bucket(zram, checksum),
+			     node) {
+		unsigned char *cmem;
+		int match;
+
+		if (entry->checksum != checksum || entry->size != clen)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->page,
+				entry->offset, ZS_MM_RO);
+		match = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		zs_unmap_object(zram->mem_pool, cmem, entry->page,
+				entry->offset, ZS_MM_RO);
+		if (match)
+			return entry;
+	}
+
+	return NULL;
+}
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
-
+	struct zram_entry *entry;
 	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+
+	/* Tell a zram_writeback() in progress that the slot changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_block(zram, zram->table[index].block);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].block = 0;
+		return;
+	}
 
 	if (unlikely(!page)) {
 		/*
@@ -154,23 +367,31 @@ static void zram_free_page(struct zram *zram, size_t index)
 		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	entry = zram->table[index].entry;
+	clen = entry->size;
 
-	xv_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
-out:
+	/* Other table entries still share this object */
+	if (--entry->refcount) {
+		zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+		goto out;
+	}
+
+	hlist_del(&entry->node);
+	zs_free(zram->mem_pool, entry->page, entry->offset);
+	kmem_cache_free(zram_entry_cache, entry);
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+
+out:
 	zram_stat_dec(&zram->stats.pages_stored);
 
 	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -190,8 +411,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -200,12 +420,75 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+/*
+ * Copy the contents of a slot held in memory to @page. Called with
+ * table_lock held and the stream from zram_dstream_get().
+ */
+static int zram_read_slot(struct zram *zram, struct zram_stream *stream,
+			u32 index, struct page *page)
+{
+	int ret;
+	unsigned int clen = PAGE_SIZE;
+	struct zram_entry *entry;
+	unsigned char *user_mem, *cmem;
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		handle_zero_page(page);
+		return 0;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	entry = zram->table[index].entry;
+	cmem = zs_map_object(zram->mem_pool, entry->page,
+			entry->offset, ZS_MM_RO);
+
+	if (stream) {
+		ret = crypto_comp_decompress(stream->tfm,
+			cmem + sizeof(struct zobj_header), entry->size,
+			user_mem, &clen);
+	} else {
+		size_t dlen = PAGE_SIZE;
+
+		ret = lzo1x_decompress_safe(cmem + sizeof(struct zobj_header),
+			entry->size, user_mem, &dlen);
+		clen = dlen;
+	}
+
+	zs_unmap_object(zram->mem_pool, cmem, entry->page,
+			entry->offset, ZS_MM_RO);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret || clen != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Pages written back to the backing device can only be read from a
+ * context that may block (!may_block is zram_make_request()). In that
+ * case -EAGAIN is returned without completing the bio, and the caller
+ * retries the whole bio from zram_read_work().
+ */
+static int zram_read(struct zram *zram, struct bio *bio, bool may_block)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_stream *stream;
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -213,26 +496,26 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	/* Only count the first attempt */
+	if (!may_block)
+		zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	/* Taken up front: we cannot sleep once table_lock is held */
+	stream = zram_dstream_get(zram);
+
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
-
-		page = bvec->bv_page;
+		unsigned long block;
+		struct page *page = bvec->bv_page;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+retry:
+		read_lock(&zram->table_lock);
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].page &&
+			     !zram_test_flag(zram, index, ZRAM_ZERO))) {
+			read_unlock(&zram->table_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -240,48 +523,87 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
+		/* Racy, but it is only a hint for zram_writeback() */
+		zram->table[index].ac_time = zram_now();
+
+		if (likely(!zram_test_flag(zram, index, ZRAM_WB))) {
+			ret = zram_read_slot(zram, stream, index, page);
+			read_unlock(&zram->table_lock);
+			if (unlikely(ret)) {
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
 			index++;
 			continue;
 		}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		block = zram->table[index].block;
+		read_unlock(&zram->table_lock);
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		if (!may_block) {
+			zram_dstream_put(zram, stream);
+			return -EAGAIN;
+		}
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+		/* Don't hold up other readers behind the I/O */
+		zram_dstream_put(zram, stream);
+		ret = zram_bdev_rw(zram, READ, page, block);
+		stream = zram_dstream_get(zram);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+				"page=%u\n", ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+		/* The slot may have been rewritten while we were reading */
+		read_lock(&zram->table_lock);
+		if (!zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram->table[index].block != block) {
+			read_unlock(&zram->table_lock);
+			goto retry;
+		}
+		read_unlock(&zram->table_lock);
 
 		flush_dcache_page(page);
 		index++;
 	}
 
+	zram_dstream_put(zram, stream);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	zram_dstream_put(zram, stream);
 	bio_io_error(bio);
 	return 0;
 }
 
+static void zram_read_work(struct work_struct *work)
+{
+	struct bio *bio;
+	struct zram *zram = container_of(work, struct zram, read_work);
+
+	for (;;) {
+		spin_lock(&zram->deferred_lock);
+		bio = bio_list_pop(&zram->deferred_reads);
+		spin_unlock(&zram->deferred_lock);
+		if (!bio)
+			break;
+
+		zram_read(zram, bio, true);
+	}
+}
+
+/*
+ * Compression runs on a stream taken from the device's pool, without any
+ * device-wide lock, so that up to max_streams pages compress in parallel.
+ * table_lock is only taken to replace the table entry once the compressed
+ * page is ready.
+ */
 static int zram_write(struct zram *zram, struct bio *bio)
 {
 	int i, ret;
@@ -298,42 +620,47 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
+		u32 offset, checksum;
+		unsigned int clen;
 		struct zobj_header *zheader;
 		struct page *page, *page_store;
+		struct zram_stream *stream;
+		struct zram_entry *entry;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		/* May sleep, so take it before kmap_atomic() */
+		stream = zram_stream_get(zram);
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+			zram_stream_put(zram, stream);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			write_lock(&zram->table_lock);
+			zram_free_page(zram, index);
+			zram->table[index].ac_time = zram_now();
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			write_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		src = stream->buffer;
+
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(stream->tfm, user_mem, PAGE_SIZE,
+					   src, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_stream_put(zram, stream);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -345,10 +672,10 @@ static int zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
+			zram_stream_put(zram, stream);
+
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -356,52 +683,118 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
+			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			write_lock(&zram->table_lock);
+			zram_free_page(zram, index);
+			zram->table[index].ac_time = zram_now();
+
+			zram->table[index].page = page_store;
 			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+			/* Update stats */
 			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			zram_stat64_add(zram, &zram->stats.compr_size,
+					PAGE_SIZE);
+			zram_stat_inc(&zram->stats.pages_stored);
+			write_unlock(&zram->table_lock);
+
+			index++;
+			continue;
+		}
+
+		/*
+		 * Identical pages compress identically: if this one is
+		 * already stored, just take another reference to it.
+		 */
+		checksum = jhash(src, clen, 0);
+
+		write_lock(&zram->table_lock);
+		entry = zram_dedup_find(zram, checksum, src, clen);
+		if (entry) {
+			/* Take the ref first: index may hold entry itself */
+			entry->refcount++;
+			zram_free_page(zram, index);
+			zram->table[index].ac_time = zram_now();
+			zram->table[index].entry = entry;
+
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dedup_saved, clen);
+			zram_stat_inc(&zram->stats.pages_stored);
+			if (clen <= PAGE_SIZE / 2)
+				zram_stat_inc(&zram->stats.good_compress);
+			write_unlock(&zram->table_lock);
+
+			zram_stream_put(zram, stream);
+			index++;
+			continue;
 		}
+		write_unlock(&zram->table_lock);
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
+		entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO);
+		if (unlikely(!entry)) {
+			zram_stream_put(zram, stream);
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out;
+		}
+
+		if (zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+				&page_store, &offset,
 				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+			zram_stream_put(zram, stream);
+			kmem_cache_free(zram_entry_cache, entry);
 			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
+				"page: %u, size=%u\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, page_store, offset,
+				ZS_MM_WO);
 
-#if 0
 		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+		zheader = (struct zobj_header *)cmem;
+		zheader->table_idx = index;
+		zheader->checksum = checksum;
+		memcpy(cmem + sizeof(*zheader), src, clen);
 
-		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, cmem, page_store, offset,
+				ZS_MM_WO);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zram_stream_put(zram, stream);
+
+		entry->page = page_store;
+		entry->offset = offset;
+		entry->size = clen;
+		entry->checksum = checksum;
+		entry->refcount = 1;
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		write_lock(&zram->table_lock);
+		zram_free_page(zram, index);
+		zram->table[index].ac_time = zram_now();
+
+		hlist_add_head(&entry->node, zram_hash_bucket(zram, checksum));
+		zram->table[index].entry = entry;
 
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->table_lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -447,7 +840,14 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 
 	switch (bio_data_dir(bio)) {
 	case READ:
-		ret = zram_read(zram, bio);
+		ret = zram_read(zram, bio, false);
+		if (ret == -EAGAIN) {
+			spin_lock(&zram->deferred_lock);
+			bio_list_add(&zram->deferred_reads, bio);
+			spin_unlock(&zram->deferred_lock);
+			queue_work(system_unbound_wq, &zram->read_work);
+			ret = 0;
+		}
 		break;
 
 	case WRITE:
@@ -458,42 +858,306 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+/*
+ * Called by zs_compact() with table_lock held for write: repoint the
+ * entry of a moved object, unless the object has no entry yet, i.e. a
+ * zram_write() is still filling it.
+ */
+static int zram_migrate(void *priv, void *obj,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset)
+{
+	struct zram *zram = priv;
+	struct zobj_header *zheader = obj;
+	struct zram_entry *entry = NULL;
+	struct hlist_node *pos;
+	u32 index = zheader->table_idx;
+
+	if (index < zram->disksize >> PAGE_SHIFT &&
+	    zram->table[index].page &&
+	    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) &&
+	    !zram_test_flag(zram, index, ZRAM_WB))
+		entry = zram->table[index].entry;
+
+	/*
+	 * The index that stored a deduplicated object may since have
+	 * dropped it: find the entry through the hash instead.
+	 */
+	if (!entry || entry->page != old_page || entry->offset != old_offset) {
+		hlist_for_each_entry(entry, pos,
+			zram_hash_bucket(zram, zheader->checksum), node) {
+			if (entry->page == old_page &&
+			    entry->offset == old_offset)
+				break;
+		}
+		if (!pos)
+			return -EBUSY;
+	}
+
+	entry->page = new_page;
+	entry->offset = new_offset;
+	zram_stat64_inc(zram, &zram->stats.num_migrated);
+
+	return 0;
+}
+
+/*
+ * Compact the memory pool one size class at a time, so that reads are
+ * only blocked while a single class is being compacted. Stops once at
+ * least nr_pages pages have been freed. Returns the number of pages
+ * freed.
+ */
+unsigned long zram_compact(struct zram *zram, unsigned long nr_pages)
+{
+	unsigned int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES && freed < nr_pages; i++) {
+		write_lock(&zram->table_lock);
+		freed += zs_compact(zram->mem_pool, i, zram_migrate, zram);
+		write_unlock(&zram->table_lock);
+		cond_resched();
+	}
+
+	zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+
+	return freed;
+}
+
+/*
+ * Automatic compaction under memory pressure. Returns the number of
+ * pages compaction could still free.
+ */
+static int zram_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	struct zram *zram = container_of(shrinker, struct zram, shrinker);
+
+	if (nr_to_scan)
+		zram_compact(zram, nr_to_scan);
+
+	return zs_get_compactable_pages(zram->mem_pool);
+}
+
+/*
+ * Open the backing device for writeback. Called with init_lock held,
+ * before the device is initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *name;
+	unsigned long *bitmap;
+	unsigned long nr_blocks;
+	struct block_device *bdev;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto fail;
+
+	/* Block 0 is never used */
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	zram_release_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->bd_name = name;
+	zram->bd_bitmap = bitmap;
+	zram->bd_nr_blocks = nr_blocks;
+
+	return 0;
+
+fail:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	kfree(name);
+	return ret;
+}
+
+void zram_release_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->bd_bitmap);
+	kfree(zram->bd_name);
+
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_name = NULL;
+	zram->bd_nr_blocks = 0;
+}
+
+/*
+ * Should this slot be written back? Called with table_lock held.
+ */
+static bool zram_wb_eligible(struct zram *zram, u32 index, int mode, u32 now)
+{
+	if (!zram->table[index].page ||
+	    zram_test_flag(zram, index, ZRAM_WB))
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	if (now - zram->table[index].ac_time < zram->wb_idle_age)
+		return false;
+
+	/* Writing back one user of a shared object frees nothing */
+	return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) ||
+		zram->table[index].entry->refcount == 1;
+}
+
+/*
+ * Move slots from memory to the backing device: incompressible ones
+ * (ZRAM_WB_HUGE) or ones not accessed for wb_idle_age seconds
+ * (ZRAM_WB_IDLE). Called with init_lock held, on an initialized device.
+ * Returns the number of pages written back.
+ */
+long zram_writeback(struct zram *zram, int mode)
+{
+	u32 index, now = zram_now();
+	long count = 0;
+	struct page *page;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		int ret;
+		unsigned long block;
+		struct zram_stream *stream;
+
+		read_lock(&zram->table_lock);
+		ret = zram_wb_eligible(zram, index, mode, now);
+		read_unlock(&zram->table_lock);
+		if (!ret)
+			continue;
+
+		block = zram_alloc_block(zram);
+		if (!block) {
+			pr_info("Backing device %s is full\n", zram->bd_name);
+			break;
+		}
+
+		/*
+		 * ZRAM_UNDER_WB is cleared by zram_free_page(), so if it is
+		 * still set once the write completes, the slot still holds
+		 * what we wrote.
+		 */
+		stream = zram_dstream_get(zram);
+		write_lock(&zram->table_lock);
+		ret = -EAGAIN;
+		if (zram_wb_eligible(zram, index, mode, now)) {
+			ret = zram_read_slot(zram, stream, index, page);
+			if (!ret)
+				zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		}
+		write_unlock(&zram->table_lock);
+		zram_dstream_put(zram, stream);
+
+		if (!ret)
+			ret = zram_bdev_rw(zram, WRITE, page, block);
+
+		write_lock(&zram->table_lock);
+		if (!ret && zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			u32 ac_time = zram->table[index].ac_time;
+
+			zram_free_page(zram, index);
+			zram->table[index].block = block;
+			zram->table[index].ac_time = ac_time;
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram_stat_inc(&zram->stats.bd_count);
+			zram_stat64_inc(zram, &zram->stats.bd_writes);
+			count++;
+		} else {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_free_block(zram, block);
+		}
+		write_unlock(&zram->table_lock);
+
+		if (ret && ret != -EAGAIN) {
+			pr_err("Writeback failed! err=%d, page=%u\n",
+				ret, index);
+			break;
+		}
+		cond_resched();
+	}
+
+	__free_page(page);
+
+	return count;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
 	mutex_lock(&zram->init_lock);
+
+	/* Compaction must not run once we start tearing down the pool */
+	if (zram->init_done)
+		unregister_shrinker(&zram->shrinker);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	flush_work_sync(&zram->read_work);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	while (!list_empty(&zram->stream_idle)) {
+		struct zram_stream *stream;
+
+		stream = list_first_entry(&zram->stream_idle,
+					  struct zram_stream, list);
+		list_del(&stream->list);
+		zram_stream_free(stream);
+	}
+	if (zram->dstream) {
+		zram_stream_free(zram->dstream);
+		zram->dstream = NULL;
+	}
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		if (zram->table[index].page)
+			zram_free_page(zram, index);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
-	zram->mem_pool = NULL;
+	vfree(zram->hash);
+	zram->hash = NULL;
+
+	zram_release_backing_dev(zram);
+
+	if (zram->mem_pool) {
+		zs_destroy_pool(zram->mem_pool);
+		zram->mem_pool = NULL;
+	}
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
@@ -505,6 +1169,7 @@ void zram_reset_device(struct zram *zram)
 int zram_init_device(struct zram *zram)
 {
 	int ret;
+	unsigned int i;
 	size_t num_pages;
 
 	mutex_lock(&zram->init_lock);
@@ -516,18 +1181,28 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
+	if (!zram->max_streams)
+		zram->max_streams = num_online_cpus();
+	for (i = 0; i < zram->max_streams; i++) {
+		struct zram_stream *stream = zram_stream_alloc(zram);
+
+		if (!stream) {
+			pr_err("Error allocating %s compression stream %u\n",
+				zram->compressor, i);
+			ret = -ENOMEM;
+			goto fail;
+		}
+		list_add(&stream->list, &zram->stream_idle);
 	}
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
+	if (strcmp(zram->compressor, "lzo")) {
+		zram->dstream = zram_stream_alloc(zram);
+		if (!zram->dstream) {
+			pr_err("Error allocating %s decompression stream\n",
+				zram->compressor);
+			ret = -ENOMEM;
+			goto fail;
+		}
 	}
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
@@ -540,18 +1215,31 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	zram->hash_mask = roundup_pow_of_two(max_t(size_t, num_pages /
+					zram_hash_ratio, 1)) - 1;
+	zram->hash = vzalloc((zram->hash_mask + 1) * sizeof(*zram->hash));
+	if (!zram->hash) {
+		pr_err("Error allocating zram dedup hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	zram->shrinker.shrink = zram_shrink;
+	zram->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&zram->shrinker);
+
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
@@ -571,7 +1259,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -584,9 +1274,19 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	rwlock_init(&zram->table_lock);
+	INIT_LIST_HEAD(&zram->stream_idle);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
+	mutex_init(&zram->dstream_lock);
+	spin_lock_init(&zram->deferred_lock);
+	bio_list_init(&zram->deferred_reads);
+	INIT_WORK(&zram->read_work, zram_read_work);
+	zram->wb_idle_age = default_wb_idle_age;
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -672,11 +1372,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -706,6 +1412,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	kmem_cache_destroy(zram_entry_cache);
 out:
 	return ret;
 }
@@ -724,6 +1432,7 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	kmem_cache_destroy(zram_entry_cache);
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
@@ -17,8 +17,14 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
 
-#include "xvmalloc.h"
+#include <linux/mm.h>
+#include <linux/bio.h>
+#include <linux/workqueue.h>
+
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -33,16 +39,28 @@ static const unsigned max_num_devices = 32;
  * object. This is required to support memory defragmentation.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
+	u32 checksum;	/* to find the zram_entry if table_idx is stale */
 };
 
 /*-- Configurable parameters */
 
+/* One dedup hash bucket per this many disk pages */
+static const unsigned zram_hash_ratio = 4;
+
+/* Slots not accessed for this long (seconds) are idle for writeback */
+static const unsigned default_wb_idle_age = 3600;
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/*
+ * Default compression backend. Any algorithm registered with the
+ * crypto compress API can be selected through the 'comp_algorithm'
+ * sysfs node before the device is initialized.
+ */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +69,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -70,16 +88,40 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is stored on the backing device */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object. Identical pages written to different disk pages
+ * share one object: each table entry holds a reference. Objects are
+ * hashed by checksum of their compressed data so duplicates can be
+ * found.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* in zram->hash */
+	struct page *page;	/* location in mem_pool */
+	u16 offset;
+	u16 size;		/* compressed size, without zobj_header */
+	u32 checksum;
+	u32 refcount;
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct page *page;	/* ZRAM_UNCOMPRESSED */
+		unsigned long block;	/* ZRAM_WB: backing device block */
+		struct zram_entry *entry;	/* otherwise */
+	};
+	u32 ac_time;	/* last access, in seconds */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -95,16 +137,60 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 stream_waits;	/* writes that had to wait for a stream */
+	u64 stream_wait_ns;	/* total time spent waiting for streams */
+	u64 num_migrated;	/* objects moved by compaction */
+	u64 pages_compacted;	/* pages freed by compaction */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* compressed bytes not stored thanks to it */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u32 bd_count;		/* no. of pages on the backing device */
+};
+
+/*
+ * A compression stream: the backend transform and output buffer needed
+ * to compress one page. Each device has a pool of max_streams of them,
+ * so that that many pages can be compressed in parallel.
+ */
+struct zram_stream {
+	struct list_head list;
+	struct crypto_comp *tfm;
+	void *buffer;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
 	struct table *table;
+	struct hlist_head *hash;	/* zram_entry by checksum */
+	unsigned long hash_mask;
+	rwlock_t table_lock;	/* protect table, hash and zram_entries;
+				 * readers only hold
+				 * it while decompressing, writers only
+				 * while installing a compressed page */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	struct list_head stream_idle;	/* idle compression streams */
+	spinlock_t stream_lock;	/* protect stream_idle */
+	wait_queue_head_t stream_wait;	/* writers waiting for a stream */
+	unsigned int max_streams;	/* set before init, via sysfs */
+	/* Decompression stream, kept apart from the writers' pool so that
+	 * reads never wait for a compression. NULL for lzo, which needs
+	 * no tfm state to decompress. */
+	struct zram_stream *dstream;
+	struct mutex dstream_lock;
+	/* Backing device for writeback, set before init */
+	struct block_device *bdev;
+	char *bd_name;
+	unsigned long *bd_bitmap;	/* allocated blocks */
+	unsigned long bd_nr_blocks;
+	u32 wb_idle_age;	/* seconds */
+	/* Reads of written back pages, which must not block in
+	 * zram_make_request() */
+	struct bio_list deferred_reads;
+	spinlock_t deferred_lock;
+	struct work_struct read_work;
+	char compressor[CRYPTO_MAX_ALG_NAME];	/* --do-- */
+	struct shrinker shrinker;	/* compacts mem_pool under pressure */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -127,5 +213,16 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern unsigned long zram_compact(struct zram *zram, unsigned long nr_pages);
+
+/* zram_writeback() modes */
+enum {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages idle for at least wb_idle_age */
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_release_backing_dev(struct zram *zram);
+extern long zram_writeback(struct zram *zram, int mode);
 
 #endif
@@ -0,0 +1,520 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are sorted into size classes and each zspage only holds
+ * objects of a single class, so freeing an object never leaves a hole
+ * that only a smaller object could use. What remains is partially used
+ * zspages, which zs_compact() empties by moving their objects into
+ * other zspages of the same class; the owner of the objects is told
+ * about every move through a callback so it can update its references.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static u32 get_class_index(u32 size)
+{
+	if (unlikely(size < ZS_MIN_ALLOC_SIZE))
+		size = ZS_MIN_ALLOC_SIZE;
+	size = ALIGN(size, ZS_SIZE_CLASS_DELTA);
+	return (size - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA;
+}
+
+/*
+ * Pick the zspage size (in pages) which wastes the least space at the
+ * end of the zspage for objects of the given size.
+ */
+static u16 get_pages_per_zspage(u32 size)
+{
+	u16 i, best = 1;
+	u32 usedpc, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+
+		usedpc = (zspage_size / size) * size * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static struct zspage *get_zspage(struct page *page)
+{
+	return (struct zspage *)page_private(page);
+}
+
+/* Object number of <page, offset> within its zspage */
+static u32 obj_to_slot(struct zspage *zspage, struct page *page, u32 offset)
+{
+	return ((page->index << PAGE_SHIFT) + offset) / zspage->class->size;
+}
+
+static void slot_to_obj(struct zspage *zspage, u32 slot,
+			struct page **page, u32 *offset)
+{
+	unsigned long pos = (unsigned long)slot * zspage->class->size;
+
+	*page = zspage->pages[pos >> PAGE_SHIFT];
+	*offset = pos & ~PAGE_MASK;
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			BITS_TO_LONGS(class->objs_per_zspage) * sizeof(long),
+			flags & ~__GFP_HIGHMEM);
+	if (unlikely(!zspage))
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (unlikely(!page))
+			goto fail;
+
+		set_page_private(page, (unsigned long)zspage);
+		page->index = i;
+		zspage->pages[i] = page;
+	}
+
+	return zspage;
+
+fail:
+	while (--i >= 0) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++) {
+		struct page *page = zspage->pages[i];
+
+		set_page_private(page, 0);
+		page->index = 0;
+		__free_page(page);
+	}
+	kfree(zspage);
+}
+
+/*
+ * Copy @len bytes between two (possibly page straddling) locations
+ * given as byte positions within their zspages.
+ */
+static void copy_object(struct zspage *dst, unsigned long dpos,
+			struct zspage *src, unsigned long spos, u32 len)
+{
+	while (len) {
+		u32 doff = dpos & ~PAGE_MASK, soff = spos & ~PAGE_MASK;
+		u32 n = min3(len, (u32)PAGE_SIZE - doff, (u32)PAGE_SIZE - soff);
+		unsigned char *d, *s;
+
+		d = kmap_atomic(dst->pages[dpos >> PAGE_SHIFT], KM_USER0);
+		s = kmap_atomic(src->pages[spos >> PAGE_SHIFT], KM_USER1);
+		memcpy(d + doff, s + soff, n);
+		kunmap_atomic(s, KM_USER1);
+		kunmap_atomic(d, KM_USER0);
+
+		dpos += n;
+		spos += n;
+		len -= n;
+	}
+}
+
+/*
+ * Create a memory pool. Sets up the size classes and the per-cpu
+ * buffers used to map objects that straddle a page boundary.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->map_buffer = __alloc_percpu(ZS_MAX_ALLOC_SIZE, ZS_ALIGN);
+	if (!pool->map_buffer) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	spin_lock_init(&pool->lock);
+
+	return pool;
+}
+
+/*
+ * All objects must have been freed before the pool is destroyed.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		if (WARN_ON(class->nr_zspages))
+			pr_err("zsmalloc: class %u still has %u zspages\n",
+				class->size, class->nr_zspages);
+	}
+
+	free_percpu(pool->map_buffer);
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @page: page no. that holds the (start of the) object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies object allocated
+ * and 0 is returned. On failure, <page, offset> is set to
+ * 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	u32 slot;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	class = &pool->classes[get_class_index(size)];
+
+	spin_lock(&pool->lock);
+
+	if (list_empty(&class->partial)) {
+		spin_unlock(&pool->lock);
+		zspage = alloc_zspage(class, flags);
+		if (unlikely(!zspage))
+			return -ENOMEM;
+
+		spin_lock(&pool->lock);
+		list_add(&zspage->list, &class->partial);
+		class->nr_zspages++;
+		pool->total_pages += class->pages_per_zspage;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+
+	slot = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	BUG_ON(slot >= class->objs_per_zspage);
+	__set_bit(slot, zspage->used);
+	class->nr_objs++;
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	spin_unlock(&pool->lock);
+
+	slot_to_obj(zspage, slot, page, offset);
+
+	return 0;
+}
+
+/*
+ * Free object identified with <page, offset>
+ */
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset)
+{
+	u32 slot;
+	struct zspage *zspage = get_zspage(page);
+	struct size_class *class = zspage->class;
+
+	slot = obj_to_slot(zspage, page, offset);
+
+	spin_lock(&pool->lock);
+
+	/* Catch double free bugs */
+	BUG_ON(!__test_and_clear_bit(slot, zspage->used));
+
+	class->nr_objs--;
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	/* No used objects in this zspage. Free it. */
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->nr_zspages--;
+		pool->total_pages -= class->pages_per_zspage;
+		spin_unlock(&pool->lock);
+
+		free_zspage(zspage);
+		return;
+	}
+
+	spin_unlock(&pool->lock);
+}
+
+/**
+ * zs_map_object - Get a dereferencable pointer to an object.
+ * @pool: pool the object belongs to
+ * @page: page no. returned by zs_malloc()
+ * @offset: offset returned by zs_malloc()
+ * @mm: whether the object will be read or written
+ *
+ * Objects contained in a single page are mapped in place with KM_USER1.
+ * Ones that straddle a page boundary are copied to (for ZS_MM_RO) or
+ * later from (for ZS_MM_WO) a per-cpu buffer. Either way, the caller
+ * must not sleep until it calls zs_unmap_object().
+ */
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm)
+{
+	struct zspage *zspage = get_zspage(page);
+	u32 size = zspage->class->size;
+	unsigned char *buf, *obj;
+
+	if (likely(offset + size <= PAGE_SIZE))
+		return kmap_atomic(page, KM_USER1) + offset;
+
+	buf = per_cpu_ptr(pool->map_buffer, get_cpu());
+	if (mm == ZS_MM_RO) {
+		u32 n = PAGE_SIZE - offset;
+
+		obj = kmap_atomic(page, KM_USER1);
+		memcpy(buf, obj + offset, n);
+		kunmap_atomic(obj, KM_USER1);
+
+		obj = kmap_atomic(zspage->pages[page->index + 1], KM_USER1);
+		memcpy(buf + n, obj, size - n);
+		kunmap_atomic(obj, KM_USER1);
+	}
+
+	return buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, void *obj, struct page *page,
+			u32 offset, enum zs_mapmode mm)
+{
+	struct zspage *zspage = get_zspage(page);
+	u32 size = zspage->class->size;
+	unsigned char *buf = obj, *dst;
+
+	if (likely(offset + size <= PAGE_SIZE)) {
+		kunmap_atomic(obj, KM_USER1);
+		return;
+	}
+
+	if (mm == ZS_MM_WO) {
+		u32 n = PAGE_SIZE - offset;
+
+		dst = kmap_atomic(page, KM_USER1);
+		memcpy(dst + offset, buf, n);
+		kunmap_atomic(dst, KM_USER1);
+
+		dst = kmap_atomic(zspage->pages[page->index + 1], KM_USER1);
+		memcpy(dst, buf + n, size - n);
+		kunmap_atomic(dst, KM_USER1);
+	}
+	put_cpu();
+}
+
+/* Partially used zspage with the fewest (@fewest) or most objects */
+static struct zspage *find_partial(struct size_class *class,
+			struct zspage *skip, bool fewest)
+{
+	struct zspage *zspage, *found = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage == skip)
+			continue;
+		if (!found || (fewest ? zspage->inuse < found->inuse :
+					zspage->inuse > found->inuse))
+			found = zspage;
+	}
+
+	return found;
+}
+
+/*
+ * Move all objects out of @src into the fullest other partial zspages.
+ * Returns false if some object could not be moved.
+ */
+static bool migrate_zspage(struct size_class *class, struct zspage *src,
+			zs_migrate_fn migrate, void *priv)
+{
+	u32 sslot, dslot;
+	bool pinned = false;
+	struct zspage *dst = NULL;
+
+	for_each_set_bit(sslot, src->used, class->objs_per_zspage) {
+		struct page *spage, *dpage;
+		u32 soffset, doffset;
+		void *obj;
+		int ret;
+
+		if (!dst) {
+			dst = find_partial(class, src, false);
+			if (!dst)
+				return false;
+		}
+
+		dslot = find_first_zero_bit(dst->used, class->objs_per_zspage);
+		__set_bit(dslot, dst->used);
+		copy_object(dst, (unsigned long)dslot * class->size,
+			    src, (unsigned long)sslot * class->size,
+			    class->size);
+
+		slot_to_obj(src, sslot, &spage, &soffset);
+		slot_to_obj(dst, dslot, &dpage, &doffset);
+
+		/* Object start is ZS_ALIGN aligned: never straddles */
+		obj = kmap_atomic(spage, KM_USER0) + soffset;
+		ret = migrate(priv, obj, spage, soffset, dpage, doffset);
+		kunmap_atomic(obj, KM_USER0);
+
+		if (ret) {
+			__clear_bit(dslot, dst->used);
+			pinned = true;
+			continue;
+		}
+
+		__clear_bit(sslot, src->used);
+		src->inuse--;
+		if (++dst->inuse == class->objs_per_zspage) {
+			list_move(&dst->list, &class->full);
+			dst = NULL;
+		}
+	}
+
+	return !pinned;
+}
+
+/**
+ * zs_compact - Free zspages of a size class by moving objects around.
+ * @pool: pool to compact
+ * @class_idx: size class, 0 to ZS_NR_CLASSES - 1
+ * @migrate: called for each object moved, see zs_migrate_fn
+ * @priv: passed to @migrate
+ *
+ * The caller must prevent concurrent access to (and frees of) objects
+ * in the pool while this runs, except for objects it will refuse to
+ * move from @migrate. Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool, unsigned int class_idx,
+			zs_migrate_fn migrate, void *priv)
+{
+	unsigned long freed = 0;
+	struct size_class *class = &pool->classes[class_idx];
+
+	spin_lock(&pool->lock);
+
+	for (;;) {
+		struct zspage *src;
+		u32 nr_free;
+		bool moved;
+
+		src = find_partial(class, NULL, true);
+		if (!src)
+			break;
+
+		/* Is there room elsewhere for all objects in src? */
+		nr_free = class->nr_zspages * class->objs_per_zspage -
+				class->nr_objs;
+		nr_free -= class->objs_per_zspage - src->inuse;
+		if (nr_free < src->inuse)
+			break;
+
+		moved = migrate_zspage(class, src, migrate, priv);
+
+		if (!src->inuse) {
+			list_del(&src->list);
+			class->nr_zspages--;
+			pool->total_pages -= class->pages_per_zspage;
+			freed += class->pages_per_zspage;
+			free_zspage(src);
+		}
+
+		if (!moved)
+			break;
+	}
+
+	spin_unlock(&pool->lock);
+
+	return freed;
+}
+
+/*
+ * Returns the number of pages zs_compact() could free at best,
+ * summed over all size classes.
+ */
+unsigned long zs_get_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		u32 nr_free;
+
+		nr_free = class->nr_zspages * class->objs_per_zspage -
+				class->nr_objs;
+		pages += nr_free / class->objs_per_zspage *
+				class->pages_per_zspage;
+	}
+
+	return pages;
+}
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return pool->total_pages << PAGE_SHIFT;
+}
@@ -0,0 +1,64 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+struct zs_pool;
+
+/*
+ * Objects are grouped into size classes ZS_SIZE_CLASS_DELTA bytes apart,
+ * from ZS_MIN_ALLOC_SIZE up to ZS_MAX_ALLOC_SIZE.
+ */
+#define ZS_ALIGN		16
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	ZS_ALIGN
+#define ZS_NR_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+enum zs_mapmode {
+	ZS_MM_RO,	/* object is only read */
+	ZS_MM_WO,	/* object is only written */
+};
+
+/*
+ * Called by zs_compact() after an object has been copied to its new
+ * location. @obj points to the (old) object, of which only the first
+ * ZS_ALIGN bytes are guaranteed to be mapped. Return 0 to commit the
+ * move, or non-zero to keep the object where it is.
+ */
+typedef int (*zs_migrate_fn)(void *priv, void *obj,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *offset, gfp_t flags);
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset);
+
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, void *obj, struct page *page,
+			u32 offset, enum zs_mapmode mm);
+
+unsigned long zs_compact(struct zs_pool *pool, unsigned int class_idx,
+			zs_migrate_fn migrate, void *priv);
+unsigned long zs_get_compactable_pages(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order pages holding objects
+ * of one size class back to back. Objects may straddle a page boundary
+ * within a zspage, which lets e.g. three 1.3K objects share a page.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* End of user params */
+
+#define ZS_MAX_OBJS_PER_ZSPAGE	\
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+struct size_class;
+
+/*
+ * Metadata for a zspage. Each of its pages points back here through
+ * page->private and stores its position within the zspage in
+ * page->index.
+ */
+struct zspage {
+	struct list_head list;	/* in class->partial or class->full */
+	struct size_class *class;
+	u16 inuse;		/* no. of allocated objects */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long used[];	/* bitmap of allocated objects */
+};
+
+struct size_class {
+	u32 size;		/* object size, ZS_ALIGN aligned */
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+
+	/* stats */
+	u32 nr_zspages;
+	u32 nr_objs;		/* allocated objects in this class */
+};
+
+struct zs_pool {
+	spinlock_t lock;
+
+	/* Per-cpu bounce buffers for zs_map_object() */
+	void __percpu *map_buffer;
+
+	struct size_class classes[ZS_NR_CLASSES];
+
+	/* stats */
+	u64 total_pages;
+};
+
+#endif
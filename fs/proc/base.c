@@ -1061,6 +1061,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (err >= 0)
+		oom_adj_notify(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1196,6 +1198,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (err >= 0)
+		oom_adj_notify(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -26,7 +26,7 @@
 struct squashfs_decompressor {
 	void	*(*init)(struct squashfs_sb_info *);
 	void	(*free)(void *);
-	int	(*decompress)(struct squashfs_sb_info *, void **,
+	int	(*decompress)(struct squashfs_sb_info *, void *, void **,
 		struct buffer_head **, int, int, int, int, int);
 	int	id;
 	char	*name;
@@ -45,13 +45,19 @@ static inline void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
 		msblk->decompressor->free(s);
 }
 
-static inline int squashfs_decompress(struct squashfs_sb_info *msblk,
-	void **buffer, struct buffer_head **bh, int b, int offset, int length,
-	int srclength, int pages)
-{
-	return msblk->decompressor->decompress(msblk, buffer, bh, b, offset,
-		length, srclength, pages);
-}
+/*
+ * Decompressor stream modes, selected with the threads= mount option.
+ * See decompressor_multi.c.
+ */
+#define SQUASHFS_THREADS_SINGLE	0
+#define SQUASHFS_THREADS_MULTI	1
+#define SQUASHFS_THREADS_PERCPU	2
+
+/* decompressor_multi.c */
+extern void *squashfs_decompressor_create(struct squashfs_sb_info *, int);
+extern void squashfs_decompressor_destroy(struct squashfs_sb_info *, void *);
+extern int squashfs_decompress(struct squashfs_sb_info *, void **,
+	struct buffer_head **, int, int, int, int, int);
 
 #ifdef CONFIG_SQUASHFS_XZ
 extern const struct squashfs_decompressor squashfs_xz_comp_ops;
@@ -0,0 +1,264 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * decompressor_multi.c
+ */
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/buffer_head.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "decompressor.h"
+#include "squashfs.h"
+
+/*
+ * This file manages the decompressor streams of a mounted filesystem.
+ *
+ * threads=single (the default) uses one stream, so all decompression is
+ * serialised, as it always has been.  threads=multi creates streams on
+ * demand, up to two per online CPU, and readers wait only when all of
+ * them are busy.  threads=percpu gives every possible CPU its own stream
+ * up front, trading memory for never having to allocate at read time.
+ */
+
+struct decomp_stream {
+	void			*stream;
+	struct list_head	list;
+};
+
+struct squashfs_percpu_stream {
+	struct mutex		mutex;
+	void			*stream;
+};
+
+struct squashfs_stream {
+	int			threads;
+
+	/* single and multi: pool of idle streams */
+	struct mutex		mutex;
+	struct list_head	strm_list;
+	wait_queue_head_t	wait;
+	int			avail_decomp;
+	int			max_decomp;
+
+	/* percpu */
+	struct squashfs_percpu_stream __percpu *percpu;
+};
+
+
+static struct decomp_stream *alloc_decomp_stream(struct squashfs_sb_info *msblk)
+{
+	struct decomp_stream *decomp = kmalloc(sizeof(*decomp), GFP_KERNEL);
+
+	if (decomp == NULL)
+		return NULL;
+
+	decomp->stream = squashfs_decompressor_init(msblk);
+	if (decomp->stream == NULL) {
+		kfree(decomp);
+		return NULL;
+	}
+
+	return decomp;
+}
+
+
+static void free_decomp_stream(struct squashfs_sb_info *msblk,
+	struct decomp_stream *decomp)
+{
+	squashfs_decompressor_free(msblk, decomp->stream);
+	kfree(decomp);
+}
+
+
+void *squashfs_decompressor_create(struct squashfs_sb_info *msblk,
+	int threads)
+{
+	struct squashfs_stream *stream;
+	struct decomp_stream *decomp;
+	int cpu;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (stream == NULL)
+		return NULL;
+
+	stream->threads = threads;
+
+	if (threads == SQUASHFS_THREADS_PERCPU) {
+		stream->percpu = alloc_percpu(struct squashfs_percpu_stream);
+		if (stream->percpu == NULL)
+			goto failed;
+
+		for_each_possible_cpu(cpu) {
+			struct squashfs_percpu_stream *pcs =
+				per_cpu_ptr(stream->percpu, cpu);
+
+			mutex_init(&pcs->mutex);
+			pcs->stream = squashfs_decompressor_init(msblk);
+			if (pcs->stream == NULL)
+				goto failed;
+		}
+
+		return stream;
+	}
+
+	mutex_init(&stream->mutex);
+	INIT_LIST_HEAD(&stream->strm_list);
+	init_waitqueue_head(&stream->wait);
+	stream->max_decomp = threads == SQUASHFS_THREADS_MULTI ?
+		num_online_cpus() * 2 : 1;
+
+	/*
+	 * Always allocate the first stream now, so that the mount fails
+	 * if there is not even enough memory for one.
+	 */
+	decomp = alloc_decomp_stream(msblk);
+	if (decomp == NULL)
+		goto failed;
+
+	list_add(&decomp->list, &stream->strm_list);
+	stream->avail_decomp = 1;
+
+	return stream;
+
+failed:
+	squashfs_decompressor_destroy(msblk, stream);
+	return NULL;
+}
+
+
+void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk, void *strm)
+{
+	struct squashfs_stream *stream = strm;
+	struct decomp_stream *decomp;
+	int cpu;
+
+	if (stream == NULL)
+		return;
+
+	if (stream->threads == SQUASHFS_THREADS_PERCPU) {
+		if (stream->percpu) {
+			for_each_possible_cpu(cpu)
+				squashfs_decompressor_free(msblk,
+					per_cpu_ptr(stream->percpu,
+						cpu)->stream);
+			free_percpu(stream->percpu);
+		}
+	} else {
+		while (!list_empty(&stream->strm_list)) {
+			decomp = list_entry(stream->strm_list.prev,
+				struct decomp_stream, list);
+			list_del(&decomp->list);
+			free_decomp_stream(msblk, decomp);
+		}
+	}
+
+	kfree(stream);
+}
+
+
+/*
+ * Take an idle stream off the pool, creating a new one if none is idle
+ * and the pool is not at its limit, otherwise wait for one to be given
+ * back.  Failing to allocate is not an error, there is always at least
+ * one stream that will eventually come back.
+ */
+static struct decomp_stream *get_decomp_stream(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	struct decomp_stream *decomp;
+
+	while (1) {
+		mutex_lock(&stream->mutex);
+
+		if (!list_empty(&stream->strm_list)) {
+			decomp = list_entry(stream->strm_list.prev,
+				struct decomp_stream, list);
+			list_del(&decomp->list);
+			mutex_unlock(&stream->mutex);
+			return decomp;
+		}
+
+		if (stream->avail_decomp < stream->max_decomp) {
+			decomp = alloc_decomp_stream(msblk);
+			if (decomp) {
+				stream->avail_decomp++;
+				mutex_unlock(&stream->mutex);
+				return decomp;
+			}
+		}
+
+		mutex_unlock(&stream->mutex);
+		wait_event(stream->wait, !list_empty(&stream->strm_list));
+	}
+}
+
+
+static void put_decomp_stream(struct squashfs_stream *stream,
+	struct decomp_stream *decomp)
+{
+	mutex_lock(&stream->mutex);
+	list_add(&decomp->list, &stream->strm_list);
+	mutex_unlock(&stream->mutex);
+	wake_up(&stream->wait);
+}
+
+
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = msblk->stream;
+	int res;
+
+	if (stream->threads == SQUASHFS_THREADS_PERCPU) {
+		struct squashfs_percpu_stream *pcs;
+		int cpu = get_cpu();
+
+		/*
+		 * Decompression may sleep waiting for buffers, so the stream
+		 * is protected by its own mutex rather than by disabling
+		 * preemption.  Being migrated meanwhile costs nothing more
+		 * than sharing a stream with another CPU's reader.
+		 */
+		put_cpu();
+		pcs = per_cpu_ptr(stream->percpu, cpu);
+
+		mutex_lock(&pcs->mutex);
+		res = msblk->decompressor->decompress(msblk, pcs->stream,
+			buffer, bh, b, offset, length, srclength, pages);
+		mutex_unlock(&pcs->mutex);
+	} else {
+		struct decomp_stream *decomp = get_decomp_stream(msblk, stream);
+
+		res = msblk->decompressor->decompress(msblk, decomp->stream,
+			buffer, bh, b, offset, length, srclength, pages);
+		put_decomp_stream(stream, decomp);
+	}
+
+	return res;
+}
@@ -61,6 +61,25 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 	return 1;
 }
 
+/*
+ * The tags of each checkpoint chunk carry a hint saying where the reader
+ * should start looking for the next checkpoint block. Point it at the
+ * block we will actually use next rather than just past the current one,
+ * so that restore does not have to read the tags of every block in
+ * between.
+ */
+static int yaffs2_checkpt_next_erased(struct yaffs_dev *dev, int start)
+{
+	int i;
+
+	for (i = start; i <= dev->internal_end_block; i++)
+		if (yaffs_get_block_info(dev, i)->block_state ==
+		    YAFFS_BLOCK_STATE_EMPTY)
+			return i;
+
+	return start;
+}
+
 static void yaffs2_checkpt_find_erased_block(struct yaffs_dev *dev)
 {
 	int i;
@@ -79,7 +98,8 @@ static void yaffs2_checkpt_find_erased_block(struct yaffs_dev *dev)
 			struct yaffs_block_info *bi =
 			    yaffs_get_block_info(dev, i);
 			if (bi->block_state == YAFFS_BLOCK_STATE_EMPTY) {
-				dev->checkpt_next_block = i + 1;
+				dev->checkpt_next_block =
+				    yaffs2_checkpt_next_erased(dev, i + 1);
 				dev->checkpt_cur_block = i;
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 					"allocating checkpt block %d", i);
@@ -253,12 +273,27 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 	return 1;
 }
 
+static void yaffs2_checkpt_sum_bytes(struct yaffs_dev *dev, const u8 * p,
+				     int n)
+{
+	u32 sum = dev->checkpt_sum;
+	u32 xor = dev->checkpt_xor;
+
+	while (n--) {
+		sum += *p;
+		xor ^= *p++;
+	}
+
+	dev->checkpt_sum = sum;
+	dev->checkpt_xor = xor;
+}
+
 int yaffs2_checkpt_wr(struct yaffs_dev *dev, const void *data, int n_bytes)
 {
 	int i = 0;
 	int ok = 1;
 
-	u8 *data_bytes = (u8 *) data;
+	const u8 *data_bytes = (const u8 *)data;
 
 	if (!dev->checkpt_buffer)
 		return 0;
@@ -266,18 +301,23 @@ int yaffs2_checkpt_wr(struct yaffs_dev *dev, const void *data, int n_bytes)
 	if (!dev->checkpt_open_write)
 		return -1;
 
+	/* Copy as much as fits in the chunk buffer at a time */
 	while (i < n_bytes && ok) {
-		dev->checkpt_buffer[dev->checkpt_byte_offs] = *data_bytes;
-		dev->checkpt_sum += *data_bytes;
-		dev->checkpt_xor ^= *data_bytes;
+		int n = dev->data_bytes_per_chunk - dev->checkpt_byte_offs;
 
-		dev->checkpt_byte_offs++;
-		i++;
-		data_bytes++;
-		dev->checkpt_byte_count++;
+		if (n > n_bytes - i)
+			n = n_bytes - i;
 
-		if (dev->checkpt_byte_offs < 0 ||
-		    dev->checkpt_byte_offs >= dev->data_bytes_per_chunk)
+		memcpy(dev->checkpt_buffer + dev->checkpt_byte_offs,
+		       data_bytes, n);
+		yaffs2_checkpt_sum_bytes(dev, data_bytes, n);
+
+		dev->checkpt_byte_offs += n;
+		i += n;
+		data_bytes += n;
+		dev->checkpt_byte_count += n;
+
+		if (dev->checkpt_byte_offs >= dev->data_bytes_per_chunk)
 			ok = yaffs2_checkpt_flush_buffer(dev);
 	}
 
@@ -302,6 +342,7 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 		return -1;
 
 	while (i < n_bytes && ok) {
+		int n;
 
 		if (dev->checkpt_byte_offs < 0 ||
 		    dev->checkpt_byte_offs >= dev->data_bytes_per_chunk) {
@@ -345,16 +386,22 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 			}
 		}
 
-		if (ok) {
-			*data_bytes =
-			    dev->checkpt_buffer[dev->checkpt_byte_offs];
-			dev->checkpt_sum += *data_bytes;
-			dev->checkpt_xor ^= *data_bytes;
-			dev->checkpt_byte_offs++;
-			i++;
-			data_bytes++;
-			dev->checkpt_byte_count++;
-		}
+		if (!ok)
+			break;
+
+		/* Copy out as much of this chunk as is wanted */
+		n = dev->data_bytes_per_chunk - dev->checkpt_byte_offs;
+		if (n > n_bytes - i)
+			n = n_bytes - i;
+
+		memcpy(data_bytes, dev->checkpt_buffer + dev->checkpt_byte_offs,
+		       n);
+		yaffs2_checkpt_sum_bytes(dev, data_bytes, n);
+
+		dev->checkpt_byte_offs += n;
+		i += n;
+		data_bytes += n;
+		dev->checkpt_byte_count += n;
 	}
 
 	return i;
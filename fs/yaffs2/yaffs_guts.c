@@ -34,11 +34,13 @@
 #include "yaffs_allocator.h"
 
 #include "yaffs_attribs.h"
+#include "yaffs_summary.h"
 
-/* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
-#define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Most gc victim candidates looked at per selection */
+#define YAFFS_GC_CANDIDATES 32
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -393,6 +395,158 @@ int yaffs_check_alloc_available(struct yaffs_dev *dev, int n_chunks)
 	return (dev->n_free_chunks > (reserved_chunks + n_chunks));
 }
 
+/*
+ * Gc victim index.
+ * Full blocks that have some free (deleted) chunks are kept on a list per
+ * number of chunks still in use, so victim selection only has to look at
+ * the emptiest blocks instead of searching the whole block array.
+ */
+
+static struct yaffs_gc_link *yaffs_gc_link(struct yaffs_dev *dev, int blk)
+{
+	return &dev->gc_links[blk - dev->internal_start_block];
+}
+
+static void yaffs_gc_index_del(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_gc_link *l = yaffs_gc_link(dev, blk);
+
+	if (l->bucket < 0)
+		return;
+
+	if (l->prev >= 0)
+		yaffs_gc_link(dev, l->prev)->next = l->next;
+	else
+		dev->gc_buckets[l->bucket] = l->next;
+	if (l->next >= 0)
+		yaffs_gc_link(dev, l->next)->prev = l->prev;
+
+	l->bucket = -1;
+}
+
+/* Put blk in the bucket matching its state and use, if any */
+static void yaffs_gc_index_update(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	struct yaffs_gc_link *l;
+	int bucket = -1;
+
+	if (!dev->gc_links)
+		return;
+
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
+		bucket = bi->pages_in_use - bi->soft_del_pages;
+		if (bucket < 0 || bucket >= dev->param.chunks_per_block)
+			bucket = -1;
+	}
+
+	l = yaffs_gc_link(dev, blk);
+	if (l->bucket == bucket)
+		return;
+
+	yaffs_gc_index_del(dev, blk);
+	if (bucket < 0)
+		return;
+
+	l->bucket = bucket;
+	l->prev = -1;
+	l->next = dev->gc_buckets[bucket];
+	if (l->next >= 0)
+		yaffs_gc_link(dev, l->next)->prev = blk;
+	dev->gc_buckets[bucket] = blk;
+}
+
+static void yaffs_gc_index_rebuild(struct yaffs_dev *dev)
+{
+	int i;
+
+	if (!dev->gc_links)
+		return;
+
+	for (i = 0; i < dev->param.chunks_per_block; i++)
+		dev->gc_buckets[i] = -1;
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		yaffs_gc_link(dev, i)->bucket = -1;
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		yaffs_gc_index_update(dev, i);
+}
+
+/*
+ * Is block a (with in_use chunks in use) a better victim than block b?
+ * Greedy selection goes for the most free space. Otherwise the
+ * cost-benefit ratio free * age / (in_use + 1) is used, which lets old
+ * blocks whose data is unlikely to change soon be collected before they
+ * are completely empty. Ties go to the older block.
+ */
+static int yaffs_gc_better(struct yaffs_dev *dev, int greedy,
+			   struct yaffs_block_info *a, int a_in_use,
+			   struct yaffs_block_info *b, int b_in_use)
+{
+	u64 a_score, b_score;
+	u32 a_age = dev->seq_number - a->seq_number + 1;
+	u32 b_age = dev->seq_number - b->seq_number + 1;
+
+	if (greedy) {
+		if (a_in_use != b_in_use)
+			return a_in_use < b_in_use;
+		return a_age > b_age;
+	}
+
+	a_score = (u64) (dev->param.chunks_per_block - a_in_use) * a_age *
+	    (b_in_use + 1);
+	b_score = (u64) (dev->param.chunks_per_block - b_in_use) * b_age *
+	    (a_in_use + 1);
+
+	if (a_score != b_score)
+		return a_score > b_score;
+	return a_age > b_age;
+}
+
+/*
+ * Pick the best victim among the full blocks with at most max_in_use
+ * chunks in use, looking at no more than YAFFS_GC_CANDIDATES blocks,
+ * emptiest first.
+ */
+static unsigned yaffs_gc_index_pick(struct yaffs_dev *dev, int max_in_use,
+				    int greedy, unsigned *in_use)
+{
+	struct yaffs_block_info *bi;
+	struct yaffs_block_info *best_bi = NULL;
+	unsigned best = 0;
+	int best_in_use = 0;
+	int n = 0;
+	int bucket;
+	int blk;
+
+	if (max_in_use >= dev->param.chunks_per_block)
+		max_in_use = dev->param.chunks_per_block - 1;
+
+	for (bucket = 0; bucket <= max_in_use && n < YAFFS_GC_CANDIDATES;
+	     bucket++) {
+		for (blk = dev->gc_buckets[bucket];
+		     blk >= 0 && n < YAFFS_GC_CANDIDATES;
+		     blk = yaffs_gc_link(dev, blk)->next) {
+			bi = yaffs_get_block_info(dev, blk);
+			if (!yaffs_block_ok_for_gc(dev, bi))
+				continue;
+			n++;
+			if (!best_bi || yaffs_gc_better(dev, greedy, bi, bucket,
+							best_bi, best_in_use)) {
+				best = blk;
+				best_bi = bi;
+				best_in_use = bucket;
+			}
+		}
+		/* Nothing further up can beat the emptiest block */
+		if (greedy && best_bi)
+			break;
+	}
+
+	if (best_bi)
+		*in_use = best_in_use;
+	return best;
+}
+
 static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 {
 	int i;
@@ -440,8 +594,8 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 	return -1;
 }
 
-static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
-			     struct yaffs_block_info **block_ptr)
+int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
+		      struct yaffs_block_info **block_ptr)
 {
 	int ret_val;
 	struct yaffs_block_info *bi;
@@ -477,6 +631,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -515,6 +670,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		    yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -604,6 +760,8 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_handle_chunk_wr_ok(dev, chunk, data, tags);
 
+		yaffs_summary_add(dev, tags, chunk);
+
 	} while (write_ok != YAFFS_OK &&
 		 (yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -662,6 +820,7 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_index_update(dev, flash_block);
 
 	dev->n_retired_blocks++;
 }
@@ -686,6 +845,65 @@ static u16 yaffs_calc_name_sum(const YCHAR * name)
 	return sum;
 }
 
+/*---------------- Directory name index ------------*/
+
+/* (Re)file obj in its parent's name index, if the parent has one. */
+static void yaffs_dir_index_place(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *parent = obj->parent;
+	struct yaffs_dir_index *index;
+
+	if (!parent || parent->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return;
+	index = parent->variant.dir_variant.index;
+	if (!index)
+		return;
+
+	if (obj->lazy_loaded || obj->hdr_chunk <= 0 ||
+	    obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		list_move(&obj->dir_index_link, &index->unsorted);
+	else
+		list_move(&obj->dir_index_link,
+			  &index->buckets[obj->sum % YAFFS_DIR_INDEX_BUCKETS]);
+}
+
+static void yaffs_dir_index_build(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index;
+	struct yaffs_obj *obj;
+	int i;
+
+	index = kmalloc(sizeof(struct yaffs_dir_index), GFP_NOFS);
+	if (!index)
+		return;	/* Not fatal, lookups just stay linear */
+
+	INIT_LIST_HEAD(&index->unsorted);
+	for (i = 0; i < YAFFS_DIR_INDEX_BUCKETS; i++)
+		INIT_LIST_HEAD(&index->buckets[i]);
+	dir->variant.dir_variant.index = index;
+
+	list_for_each_entry(obj, &dir->variant.dir_variant.children, siblings)
+		yaffs_dir_index_place(obj);
+
+	yaffs_trace(YAFFS_TRACE_OS, "built name index for directory %d",
+		dir->obj_id);
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_obj *obj;
+
+	if (dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY ||
+	    !dir->variant.dir_variant.index)
+		return;
+
+	list_for_each_entry(obj, &dir->variant.dir_variant.children, siblings)
+		list_del_init(&obj->dir_index_link);
+
+	kfree(dir->variant.dir_variant.index);
+	dir->variant.dir_variant.index = NULL;
+}
+
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
 #ifndef CONFIG_YAFFS_NO_SHORT_NAMES
@@ -698,6 +916,7 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 		obj->short_name[0] = _Y('\0');
 #endif
 	obj->sum = yaffs_calc_name_sum(name);
+	yaffs_dir_index_place(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -744,6 +963,14 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct yaffs_obj *obj;
+	int i;
+
+	/* Objects are released wholesale below, free their name indices */
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++)
+		list_for_each_entry(obj, &dev->obj_bucket[i].list, hash_link)
+			yaffs_dir_index_free(obj);
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -1201,6 +1428,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_index_update(dev, block_no);
 	}
 }
 
@@ -1282,6 +1510,7 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 		dev->param.remove_obj_fn(obj);
 
 	list_del_init(&obj->siblings);
+	list_del_init(&obj->dir_index_link);
 	obj->parent = NULL;
 
 	yaffs_verify_dir(parent);
@@ -1315,6 +1544,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_dir_index_place(obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1394,20 +1624,77 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cached chunks are found through a hash on (object, chunk_id) and recycled
+ *   in least recently used order, so the cache can be sized in the hundreds
+ *   without every lookup having to scan it.
  */
 
-static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_hash[(obj->obj_id * 31 + chunk_id) &
+				dev->cache_hash_mask];
+}
+
+/* Hook a free cache up to a chunk, keeping the object's list sorted */
+static void yaffs_cache_attach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	struct list_head *i;
+	struct yaffs_cache *c;
+
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+
+	list_for_each(i, &obj->cache_list) {
+		c = list_entry(i, struct yaffs_cache, obj_link);
+		if (c->chunk_id > chunk_id)
+			break;
+	}
+	list_add_tail(&cache->obj_link, i);
+}
+
+/* Drop whatever the cache holds and make it the next one to be reused */
+static void yaffs_cache_detach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache)
+{
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->obj_link);
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+	cache->object = NULL;
+	cache->dirty = 0;
+}
+
+static struct yaffs_cache *yaffs_cache_lookup(const struct yaffs_obj *obj,
+					      int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	list_for_each(i, yaffs_cache_bucket(dev, obj, chunk_id)) {
+		cache = list_entry(i, struct yaffs_cache, hash_link);
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
+	}
+	return NULL;
+}
+
+static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+{
+	struct list_head *i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
+	list_for_each(i, &obj->cache_list) {
+		cache = list_entry(i, struct yaffs_cache, obj_link);
+		if (cache->dirty)
 			return 1;
 	}
 
@@ -1417,39 +1704,38 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct list_head *i;
 	struct yaffs_cache *cache;
 	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	if (n_caches > 0) {
+	if (dev->param.n_caches > 0) {
 		do {
+			/* The object's list is sorted, so the first dirty
+			 * cache is the one with the lowest chunk id.
+			 */
 			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
+			list_for_each(i, &obj->cache_list) {
+				cache = list_entry(i, struct yaffs_cache,
+						   obj_link);
+				if (cache->dirty && !cache->locked)
+					break;
+				cache = NULL;
 			}
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+			if (cache) {
+				/* Write it out and free it up, even if the
+				 * write failed: a cache that can never be
+				 * written back must not stay dirty forever.
+				 */
 
 				chunk_written =
 				    yaffs_wr_data_obj(cache->object,
 						      cache->chunk_id,
 						      cache->data,
 						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				if (chunk_written > 0)
+					dev->cache_writebacks++;
+				yaffs_cache_detach(dev, cache);
 			}
 
 		} while (cache && chunk_written > 0);
@@ -1471,18 +1757,25 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	if (dev->param.n_caches <= 0)
+		return;
 
 	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	 * until there are no further dirty objects. Each flush frees at
+	 * least the object's first dirty cache, written or not, so an
+	 * object that fails to flush does not stop the others.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
+		list_for_each(i, &dev->cache_lru) {
+			cache = list_entry(i, struct yaffs_cache, lru_link);
+			if (cache->object && cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
 		if (obj)
 			yaffs_flush_file_cache(obj);
@@ -1492,19 +1785,19 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 }
 
 /* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Unused caches sit at the tail of the LRU list, so the tail is either
+ * free or the least recently used one. If that is dirty, flush its
+ * object and look again.
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
+	struct list_head *i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	list_for_each_prev(i, &dev->cache_lru) {
+		cache = list_entry(i, struct yaffs_cache, lru_link);
+		if (!cache->locked)
+			return cache;
 	}
 
 	return NULL;
@@ -1513,72 +1806,70 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
 		cache = yaffs_grab_chunk_worker(dev);
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+		if (cache && cache->dirty) {
+			/* Flush and try again */
+			yaffs_flush_file_cache(cache->object);
+			cache = yaffs_grab_chunk_worker(dev);
+			/* Only if its dirty caches are all locked; the
+			 * callers then bypass the cache.
 			 */
+			if (cache && cache->dirty)
+				cache = NULL;
+		}
 
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+		if (cache && cache->object)
+			yaffs_cache_detach(dev, cache);
 
-		}
 		return cache;
 	} else {
 		return NULL;
         }
 }
 
+/* Grab a cache chunk to read into.
+ * Unlike yaffs_grab_chunk_cache() this never writes anything out, as
+ * readers may be in the core together (see core_lock). It takes the least
+ * recently used clean cache, or none if they are all dirty or locked.
+ */
+static struct yaffs_cache *yaffs_grab_read_cache(struct yaffs_dev *dev)
+{
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	if (dev->param.n_caches <= 0)
+		return NULL;
+
+	list_for_each_prev(i, &dev->cache_lru) {
+		cache = list_entry(i, struct yaffs_cache, lru_link);
+		if (!cache->locked && !cache->dirty) {
+			if (cache->object)
+				yaffs_cache_detach(dev, cache);
+			return cache;
+		}
+	}
+
+	return NULL;
+}
+
 /* Find a cached chunk */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache = NULL;
 
-				return &dev->cache[i];
-			}
-		}
+	if (dev->param.n_caches > 0) {
+		cache = yaffs_cache_lookup(obj, chunk_id);
+		if (cache)
+			dev->cache_hits++;
+		else
+			dev->cache_misses++;
 	}
-	return NULL;
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -1587,21 +1878,16 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
+		list_move(&cache->lru_link, &dev->cache_lru);
 
-		cache->last_use = dev->cache_last_use;
-
-		if (is_write)
+		if (is_write) {
+			/* Small writes to the same chunk only go to NAND
+			 * once, when the cache is flushed.
+			 */
+			if (cache->dirty)
+				dev->cache_coalesced++;
 			cache->dirty = 1;
+		}
 	}
 }
 
@@ -1611,12 +1897,14 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
  */
 static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
-	if (object->my_dev->param.n_caches > 0) {
+	struct yaffs_dev *dev = object->my_dev;
+
+	if (dev->param.n_caches > 0) {
 		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+		    yaffs_cache_lookup(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_detach(dev, cache);
 	}
 }
 
@@ -1625,15 +1913,15 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct list_head *i;
+	struct list_head *n;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
+		list_for_each_safe(i, n, &in->cache_list)
+			yaffs_cache_detach(dev, list_entry(i, struct yaffs_cache,
+							   obj_link));
 	}
 }
 
@@ -1673,6 +1961,8 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 		return;
 	}
 
+	yaffs_invalidate_whole_cache(obj);
+	yaffs_dir_index_free(obj);
 	yaffs_unhash_obj(obj);
 
 	yaffs_free_raw_obj(dev, obj);
@@ -1857,6 +2147,8 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
 		INIT_LIST_HEAD(&obj->siblings);
+		INIT_LIST_HEAD(&obj->dir_index_link);
+		INIT_LIST_HEAD(&obj->cache_list);
 
 		/* Now make the directory sane */
 		if (dev->root_dir) {
@@ -2010,6 +2302,7 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			INIT_LIST_HEAD(&the_obj->variant.dir_variant.children);
 			INIT_LIST_HEAD(&the_obj->variant.dir_variant.dirty);
+			the_obj->variant.dir_variant.index = NULL;
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
 		case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -2304,6 +2597,8 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 
 	dev->block_info = NULL;
 	dev->chunk_bits = NULL;
+	dev->gc_links = NULL;
+	dev->gc_buckets = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
 
@@ -2333,9 +2628,26 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	}
 
 	if (dev->block_info && dev->chunk_bits) {
+		dev->gc_links =
+		    kmalloc(n_blocks * sizeof(struct yaffs_gc_link), GFP_NOFS);
+		if (!dev->gc_links) {
+			dev->gc_links =
+			    vmalloc(n_blocks * sizeof(struct yaffs_gc_link));
+			dev->gc_links_alt = 1;
+		} else {
+			dev->gc_links_alt = 0;
+		}
+		dev->gc_buckets =
+		    kmalloc(dev->param.chunks_per_block * sizeof(int),
+			    GFP_NOFS);
+	}
+
+	if (dev->block_info && dev->chunk_bits &&
+	    dev->gc_links && dev->gc_buckets) {
 		memset(dev->block_info, 0,
 		       n_blocks * sizeof(struct yaffs_block_info));
 		memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
+		yaffs_gc_index_rebuild(dev);
 		return YAFFS_OK;
 	}
 
@@ -2359,6 +2671,16 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+
+	if (dev->gc_links_alt && dev->gc_links)
+		vfree(dev->gc_links);
+	else if (dev->gc_links)
+		kfree(dev->gc_links);
+	dev->gc_links_alt = 0;
+	dev->gc_links = NULL;
+
+	kfree(dev->gc_buckets);
+	dev->gc_buckets = NULL;
 }
 
 void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
@@ -2379,6 +2701,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_index_update(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if (block_no == dev->gc_block)
@@ -2468,8 +2791,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_index_update(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2679,6 +3004,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_index_update(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2724,7 +3050,6 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				    int aggressive, int background)
 {
 	int i;
-	int iterations;
 	unsigned selected = 0;
 	int prioritised = 0;
 	int prioritised_exist = 0;
@@ -2770,12 +3095,10 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	 */
 
 	if (!selected) {
-		int pages_used;
-		int n_blocks =
-		    dev->internal_end_block - dev->internal_start_block + 1;
+		unsigned in_use = 0;
+
 		if (aggressive) {
 			threshold = dev->param.chunks_per_block;
-			iterations = n_blocks;
 		} else {
 			int max_threshold;
 
@@ -2792,38 +3115,17 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 			if (threshold > max_threshold)
 				threshold = max_threshold;
-
-			iterations = n_blocks / 16 + 1;
-			if (iterations > 100)
-				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH); i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
-			}
+		/* When space is needed now take the emptiest block, otherwise
+		 * weigh the space gained against the age of the data.
+		 */
+		selected = yaffs_gc_index_pick(dev, threshold, aggressive,
+					       &in_use);
+		if (selected) {
+			dev->gc_dirtiest = selected;
+			dev->gc_pages_in_use = in_use;
 		}
-
-		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
-			selected = dev->gc_dirtiest;
 	}
 
 	/*
@@ -2865,8 +3167,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	} else {
 		dev->gc_not_done++;
 		yaffs_trace(YAFFS_TRACE_GC,
-			"GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s",
-			dev->gc_block_finder, dev->gc_not_done, threshold,
+			"GC none: skip %d threshold %d dirtiest %d using %d oldest %d%s",
+			dev->gc_not_done, threshold,
 			dev->gc_dirtiest, dev->gc_pages_in_use,
 			dev->oldest_dirty_block, background ? " bg" : "");
 	}
@@ -2991,22 +3293,26 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 /*-------------------- Data file manipulation -----------------*/
 
-static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+static int yaffs_rd_data_chunk(struct yaffs_dev *dev, int nand_chunk,
+			       u8 * buffer)
 {
-	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
-
 	if (nand_chunk >= 0)
-		return yaffs_rd_chunk_tags_nand(in->my_dev, nand_chunk,
-						buffer, NULL);
+		return yaffs_rd_chunk_tags_nand(dev, nand_chunk, buffer, NULL);
 	else {
 		yaffs_trace(YAFFS_TRACE_NANDACCESS,
 			"Chunk %d not found zero instead",
 			nand_chunk);
 		/* get sane (zero) data if you read a hole */
-		memset(buffer, 0, in->my_dev->data_bytes_per_chunk);
+		memset(buffer, 0, dev->data_bytes_per_chunk);
 		return 0;
 	}
+}
 
+static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+{
+	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
+
+	return yaffs_rd_data_chunk(in->my_dev, nand_chunk, buffer);
 }
 
 void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
@@ -3067,6 +3373,8 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		    bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
 		    bi->block_state != YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
 			yaffs_block_became_dirty(dev, block);
+		} else {
+			yaffs_gc_index_update(dev, block);
 		}
 
 	}
@@ -3498,6 +3806,7 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 		if (new_chunk_id >= 0) {
 
 			in->hdr_chunk = new_chunk_id;
+			yaffs_dir_index_place(in);
 
 			if (prev_chunk_id > 0) {
 				yaffs_chunk_del(dev, prev_chunk_id, 1,
@@ -3542,6 +3851,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 {
 
 	int chunk;
+	int nand_chunk;
 	u32 start;
 	int n_copy;
 	int n = n_bytes;
@@ -3566,6 +3876,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		else
 			n_copy = dev->data_bytes_per_chunk - start;
 
+		mutex_lock(&dev->core_lock);
+
 		cache = yaffs_find_chunk_cache(in, chunk);
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
@@ -3574,22 +3886,19 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk
 		    || dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
+			/* If we can't find the data in the cache, then load it up. */
 
-				/* If we can't find the data in the cache, then load it up. */
-
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+			if (!cache && dev->param.n_caches > 0) {
+				cache = yaffs_grab_read_cache(dev);
+				if (cache) {
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
+			}
 
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3610,10 +3919,20 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 							  __LINE__);
 			}
 
+			mutex_unlock(&dev->core_lock);
+
 		} else {
 
-			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_rd_data_obj(in, chunk, buffer);
+			/* A full chunk. Read directly into the supplied buffer.
+			 * Only writers and gc move chunks, and they never run
+			 * alongside readers, so the NAND read itself can be
+			 * done without core_lock.
+			 */
+			nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+
+			mutex_unlock(&dev->core_lock);
+
+			yaffs_rd_data_chunk(dev, nand_chunk, buffer);
 
 		}
 
@@ -3706,13 +4025,14 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
+					/* NULL if every cache is locked */
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					if (cache) {
+						yaffs_cache_attach(dev, cache,
+								   in, chunk);
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+					}
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -4466,10 +4786,54 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+/* Does child l of a directory go by the given name (with name sum 'sum')? */
+static int yaffs_obj_name_matches(struct yaffs_obj *l, const YCHAR * name,
+				  int sum, YCHAR * buffer)
+{
+	/* Special case for lost-n-found */
+	if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return !strcmp(name, YAFFS_LOSTNFOUND_NAME);
+
+	if (l->sum == sum || l->hdr_chunk <= 0) {
+		/* LostnFound chunk called Objxxx
+		 * Do a real check
+		 */
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		return strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0;
+	}
+
+	return 0;
+}
+
+static struct yaffs_obj *yaffs_find_by_name_indexed(struct yaffs_obj *directory,
+						    const YCHAR * name, int sum,
+						    YCHAR * buffer)
+{
+	struct yaffs_dir_index *index = directory->variant.dir_variant.index;
+	struct yaffs_obj *l, *n;
+
+	list_for_each_entry(l, &index->buckets[sum % YAFFS_DIR_INDEX_BUCKETS],
+			    dir_index_link) {
+		if (l->sum == sum && yaffs_obj_name_matches(l, name, sum, buffer))
+			return l;
+	}
+
+	/* Children not sorted yet: load them and file them as we go */
+	list_for_each_entry_safe(l, n, &index->unsorted, dir_index_link) {
+		yaffs_check_obj_details_loaded(l);
+		yaffs_dir_index_place(l);
+		if (yaffs_obj_name_matches(l, name, sum, buffer))
+			return l;
+	}
+
+	return NULL;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR * name)
 {
 	int sum;
+	int n_children = 0;
 
 	struct list_head *i;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
@@ -4495,6 +4859,9 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
+	if (directory->variant.dir_variant.index)
+		return yaffs_find_by_name_indexed(directory, name, sum, buffer);
+
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		if (i) {
 			l = list_entry(i, struct yaffs_obj, siblings);
@@ -4504,24 +4871,16 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 			yaffs_check_obj_details_loaded(l);
 
-			/* Special case for lost-n-found */
-			if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-					return l;
-			} else if (l->sum == sum
-				   || l->hdr_chunk <= 0) {
-				/* LostnFound chunk called Objxxx
-				 * Do a real check
-				 */
-				yaffs_get_obj_name(l, buffer,
-						   YAFFS_MAX_NAME_LENGTH + 1);
-				if (strncmp
-				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
-			}
+			if (yaffs_obj_name_matches(l, name, sum, buffer))
+				return l;
+			n_children++;
 		}
 	}
 
+	/* We just walked a big directory for nothing, index it for next time */
+	if (n_children >= YAFFS_DIR_INDEX_MIN_CHILDREN)
+		yaffs_dir_index_build(directory);
+
 	return NULL;
 }
 
@@ -4776,6 +5135,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	mutex_init(&dev->core_lock);
+	mutex_init(&dev->nand_lock);
+
 	dev->internal_start_block = dev->param.start_block;
 	dev->internal_end_block = dev->param.end_block;
 	dev->block_offset = 0;
@@ -4916,7 +5278,6 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
-	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
@@ -4941,36 +5302,57 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		int n_buckets = 1;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+
+		/* About one hash bucket per cache */
+		while (n_buckets < dev->param.n_caches)
+			n_buckets <<= 1;
+		dev->cache_hash_mask = n_buckets - 1;
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash =
+		    kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
+		if (!dev->cache_hash)
+			buf = NULL;
+
+		for (i = 0; i < n_buckets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].obj_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_writebacks = 0;
+	dev->cache_coalesced = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4983,6 +5365,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (dev->param.is_yaffs2)
 		dev->param.use_header_file_size = 1;
 
+	if (!init_failed)
+		yaffs_summary_init(dev);
+
 	if (!init_failed && !yaffs_init_blocks(dev))
 		init_failed = 1;
 
@@ -5032,6 +5417,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
                 }
 
+		/* Block info came from a scan or the checkpoint */
+		yaffs_gc_index_rebuild(dev);
+
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
@@ -5087,8 +5475,11 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
 
 		kfree(dev->gc_cleanup_list);
+		yaffs_summary_deinit(dev);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			kfree(dev->temp_buffer[i].buffer);
@@ -57,6 +57,12 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Directories with at least this many children get a name index. 127
+ * buckets plus the unsorted list make the index 1KB on 32 bit machines.
+ */
+#define YAFFS_DIR_INDEX_MIN_CHILDREN	32
+#define YAFFS_DIR_INDEX_BUCKETS		127
+
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
 
@@ -83,7 +89,12 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+/* Block summary chunks. Deliberately outside the object id space so that
+ * scanning code treats them as garbage.
+ */
+#define YAFFS_OBJECTID_SUMMARY		0x80000
+
+#define YAFFS_MAX_SHORT_OP_CACHES	512
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -106,11 +117,17 @@
 /* Special sequence number for bad block that failed to be marked bad */
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xFFFF0000
 
-/* ChunkCache is used for short read/write operations.*/
+/* ChunkCache is used for short read/write operations.
+ * In-use entries are hashed on (object, chunk_id) and also kept on their
+ * object's list in chunk_id order, so that flushing a file writes its
+ * chunks out sequentially.
+ */
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash, if in use */
+	struct list_head obj_link;	/* In object->cache_list, if in use */
+	struct list_head lru_link;	/* In dev->cache_lru, most recent first */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -354,9 +371,20 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+/* In-RAM index of a directory's children, hashed by name sum. Children
+ * whose sum is not known yet (lazy loaded, no header written yet) or is
+ * not usable (lost+found) sit on the unsorted list and get sorted into
+ * their bucket by the next lookup.
+ */
+struct yaffs_dir_index {
+	struct list_head unsorted;
+	struct list_head buckets[YAFFS_DIR_INDEX_BUCKETS];
+};
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_dir_index *index;	/* Name index, built on demand */
 };
 
 struct yaffs_symlink_var {
@@ -412,6 +440,8 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct list_head dir_index_link;	/* in the parent's name index */
+	struct list_head cache_list;	/* short op caches holding our chunks */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -574,6 +604,7 @@ struct yaffs_param {
 	int auto_unicode;
 #endif
 	int always_check_erased;	/* Force chunk erased check always on */
+	int disable_summary;	/* Don't write block summaries (yaffs2) */
 };
 
 struct yaffs_dev {
@@ -662,9 +693,16 @@ struct yaffs_dev {
 	u32 *gc_cleanup_list;	/* objects to delete at the end of a GC. */
 	u32 n_clean_ups;
 
+	/* Gc victim index: full blocks with some free space, bucketed by
+	 * the number of chunks still in use. Kept outside block_info because
+	 * that gets written to the checkpoint as is.
+	 */
+	struct yaffs_gc_link *gc_links;	/* One per block */
+	int *gc_buckets;	/* Heads, one per in-use count */
+	unsigned gc_links_alt:1;	/* was allocated using alternative strategy */
+
 	unsigned has_pending_prioritised_gc;	/* We think this device might have pending prioritised gcs */
 	unsigned gc_disable;
-	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
 	unsigned gc_not_done;
@@ -685,7 +723,19 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head cache_lru;	/* All caches, unused ones at the tail */
+	struct list_head *cache_hash;
+	int cache_hash_mask;
+
+	/* Concurrent readers. The os layer may let lookups, readdir and file
+	 * reads into the core together, though never alongside anything
+	 * else. They take core_lock around the state they change: the chunk
+	 * cache, temp buffers, lazily loaded objects and directory indexes.
+	 * NAND reads take nand_lock, which nests inside core_lock, so that
+	 * a whole chunk can be read without holding the other readers up.
+	 */
+	struct mutex core_lock;
+	struct mutex nand_lock;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -713,6 +763,11 @@ struct yaffs_dev {
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
+	/* Block summaries */
+	int chunks_per_summary;	/* Chunks per block described by the summary */
+	struct yaffs_summary_tags *sum_tags;
+	int sum_block;		/* Block sum_tags is being collected for */
+
 	/* Statistcs */
 	u32 n_page_writes;
 	u32 n_page_reads;
@@ -734,6 +789,11 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_writebacks;	/* Dirty caches written out */
+	u32 cache_coalesced;	/* Writes merged into an already dirty cache */
+	u32 n_summary_scans;	/* Blocks scanned using their summary */
+	u32 n_full_scans;	/* Blocks scanned by reading every chunk's tags */
 
 };
 
@@ -756,6 +816,20 @@ struct yaffs_checkpt_dev {
 
 };
 
+/* Links a block into its gc victim bucket, see yaffs_dev.gc_links */
+struct yaffs_gc_link {
+	int prev;
+	int next;
+	int bucket;		/* -1 if not indexed */
+};
+
+/* Per-chunk entry of a block summary */
+struct yaffs_summary_tags {
+	u32 obj_id;
+	u32 chunk_id;
+	u32 n_bytes;
+};
+
 struct yaffs_checkpt_validity {
 	int struct_type;
 	u32 magic;
@@ -891,6 +965,8 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name,
 void yaffs_handle_shadowed_obj(struct yaffs_dev *dev, int obj_id,
 			       int backward_scanning);
 int yaffs_check_alloc_available(struct yaffs_dev *dev, int n_chunks);
+int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
+		      struct yaffs_block_info **block_ptr);
 struct yaffs_tnode *yaffs_get_tnode(struct yaffs_dev *dev);
 struct yaffs_tnode *yaffs_add_find_tnode_0(struct yaffs_dev *dev,
 					   struct yaffs_file_var *file_struct,
@@ -24,14 +24,40 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	struct rw_semaphore gross_lock;	/* Gross locking, see yaffs_vfs.c */
+	atomic_t gross_lock_waiters;	/* Tasks blocked on gross_lock */
+	u64 gross_lock_taken;	/* local_clock() when last acquired */
+
+	/* gross_lock statistics, only updated with gross_lock held
+	 * exclusively
+	 */
+	unsigned gross_lock_count;
+	unsigned gross_lock_contended;
+	u64 gross_lock_wait_ns;
+	u64 gross_lock_hold_ns;
+	u64 gross_lock_max_hold_ns;
+
+	/* The same for shared holds, which may be taken concurrently */
+	atomic_t gross_lock_shared_count;
+	atomic_t gross_lock_shared_contended;
+	atomic64_t gross_lock_shared_wait_ns;
+	unsigned bg_gc_yields;	/* Background gc passes left to waiters */
+	unsigned bg_gc_idle_passes;	/* Extra background gc passes when idle */
+	unsigned long last_fg_use;	/* jiffies when last locked by a user */
+
+	/* Checkpoint and mount timing */
+	unsigned checkpt_saves;
+	unsigned checkpt_save_us;	/* Duration of the last save */
+	unsigned checkpt_save_max_us;
+	unsigned mount_us;	/* Time taken by yaffs_guts_initialise() */
+	int mount_from_checkpt;
+
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
-	struct task_struct *readdir_process;
 	unsigned mount_id;
 };
 
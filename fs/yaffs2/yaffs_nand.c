@@ -25,6 +25,8 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 
 	int realigned_chunk = nand_chunk - dev->chunk_offset;
 
+	mutex_lock(&dev->nand_lock);
+
 	dev->n_page_reads++;
 
 	/* If there are no tags provided, use local tags to get prioritised gc working */
@@ -47,6 +49,8 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 		yaffs_handle_chunk_error(dev, bi);
 	}
 
+	mutex_unlock(&dev->nand_lock);
+
 	return result;
 }
 
@@ -0,0 +1,274 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Block summaries.
+ *
+ * While a block is being written, the tags of each of its chunks are
+ * collected in dev->sum_tags. The last few chunks of the block are not
+ * used for data. When the other chunks are full, the collected tags are
+ * written to them. A mount without a valid checkpoint can then read one
+ * summary per block instead of the tags of every chunk.
+ *
+ * Summary chunks use an object id outside the object id space, so the
+ * scanner treats them as garbage. This also holds for scanners that do
+ * not know about summaries. Nothing refers to them, so they are deleted
+ * as soon as they are written and gc never has to copy them.
+ */
+
+#include "yaffs_summary.h"
+#include "yaffs_nand.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_trace.h"
+
+#define YAFFS_SUMMARY_VERSION	1
+
+/* Each summary chunk starts with a copy of this header */
+struct yaffs_summary_header {
+	u32 version;
+	u32 block;
+	u32 seq;
+	u32 sum;
+};
+
+static int yaffs_summary_per_chunk(struct yaffs_dev *dev)
+{
+	return (dev->data_bytes_per_chunk -
+		sizeof(struct yaffs_summary_header)) /
+	    sizeof(struct yaffs_summary_tags);
+}
+
+static u32 yaffs_summary_sum(struct yaffs_dev *dev)
+{
+	u8 *p = (u8 *) dev->sum_tags;
+	int n = dev->chunks_per_summary * sizeof(struct yaffs_summary_tags);
+	u32 sum = 0;
+
+	/* BSD checksum, so that swapped entries are noticed */
+	while (n--)
+		sum = ((sum >> 1) | (sum << 31)) + *p++;
+
+	return sum;
+}
+
+void yaffs_summary_init(struct yaffs_dev *dev)
+{
+	int per_chunk = yaffs_summary_per_chunk(dev);
+	int n_sum_chunks;
+
+	dev->sum_tags = NULL;
+	dev->sum_block = -1;
+	dev->chunks_per_summary = 0;
+
+	if (!dev->param.is_yaffs2 || dev->param.disable_summary ||
+	    per_chunk < 1)
+		return;
+
+	/* Use as few chunks as will describe the rest of the block */
+	n_sum_chunks = 1;
+	while (n_sum_chunks * per_chunk <
+	       dev->param.chunks_per_block - n_sum_chunks)
+		n_sum_chunks++;
+
+	if (n_sum_chunks >= dev->param.chunks_per_block / 2)
+		return;
+
+	dev->sum_tags = kmalloc((dev->param.chunks_per_block - n_sum_chunks) *
+				sizeof(struct yaffs_summary_tags), GFP_NOFS);
+	if (!dev->sum_tags) {
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"yaffs: could not allocate summary, disabled");
+		return;
+	}
+
+	dev->chunks_per_summary = dev->param.chunks_per_block - n_sum_chunks;
+}
+
+void yaffs_summary_deinit(struct yaffs_dev *dev)
+{
+	kfree(dev->sum_tags);
+	dev->sum_tags = NULL;
+	dev->chunks_per_summary = 0;
+}
+
+static void yaffs_summary_write(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_ext_tags tags;
+	struct yaffs_summary_header hdr;
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	struct yaffs_summary_tags *st = dev->sum_tags;
+	int per_chunk = yaffs_summary_per_chunk(dev);
+	int n_left = dev->chunks_per_summary;
+	int result = YAFFS_OK;
+	int chunk_id = 1;
+	u8 *buffer;
+
+	hdr.version = YAFFS_SUMMARY_VERSION;
+	hdr.block = blk;
+	hdr.seq = bi->seq_number;
+	hdr.sum = yaffs_summary_sum(dev);
+
+	buffer = yaffs_get_temp_buffer(dev, __LINE__);
+
+	/* The allocator moves on once the last chunk of blk is taken */
+	while (result == YAFFS_OK && dev->alloc_block == blk) {
+		int n = min(n_left, per_chunk);
+		int chunk = yaffs_alloc_chunk(dev, 1, NULL);
+
+		if (chunk < 0)
+			break;
+
+		memset(buffer, 0xff, dev->data_bytes_per_chunk);
+		memcpy(buffer, &hdr, sizeof(hdr));
+		memcpy(buffer + sizeof(hdr), st, n * sizeof(*st));
+
+		yaffs_init_tags(&tags);
+		tags.obj_id = YAFFS_OBJECTID_SUMMARY;
+		tags.chunk_id = chunk_id++;
+		tags.n_bytes = sizeof(hdr) + n * sizeof(*st);
+
+		result = yaffs_wr_chunk_tags_nand(dev, chunk, buffer, &tags);
+		yaffs_chunk_del(dev, chunk, 0, __LINE__);
+
+		st += n;
+		n_left -= n;
+	}
+
+	yaffs_release_temp_buffer(dev, buffer, __LINE__);
+
+	if (result != YAFFS_OK)
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs: failed to write summary for block %d", blk);
+}
+
+/*
+ * yaffs_summary_add() records the tags of a chunk that has just been
+ * written, and writes the summary once the block's data area is full.
+ */
+void yaffs_summary_add(struct yaffs_dev *dev, struct yaffs_ext_tags *tags,
+		       int chunk_in_nand)
+{
+	int blk = chunk_in_nand / dev->param.chunks_per_block;
+	int chunk_in_block = chunk_in_nand % dev->param.chunks_per_block;
+	struct yaffs_summary_tags *st;
+
+	if (!dev->sum_tags)
+		return;
+
+	if (chunk_in_block == 0)
+		dev->sum_block = blk;
+	else if (blk != dev->sum_block)
+		return;	/* We missed the start of this block */
+
+	if (chunk_in_block >= dev->chunks_per_summary)
+		return;
+
+	st = &dev->sum_tags[chunk_in_block];
+	st->obj_id = tags->obj_id;
+	st->chunk_id = tags->chunk_id;
+	st->n_bytes = tags->n_bytes;
+
+	if (chunk_in_block == dev->chunks_per_summary - 1) {
+		dev->sum_block = -1;
+		yaffs_summary_write(dev, blk);
+	}
+}
+
+/*
+ * yaffs_summary_read() loads the summary of a block into dev->sum_tags.
+ * Returns 1 if the block has a complete and valid summary.
+ */
+int yaffs_summary_read(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_ext_tags tags;
+	struct yaffs_summary_header hdr;
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	struct yaffs_summary_tags *st = dev->sum_tags;
+	int per_chunk = yaffs_summary_per_chunk(dev);
+	int n_left = dev->chunks_per_summary;
+	int chunk = blk * dev->param.chunks_per_block + dev->chunks_per_summary;
+	int end = (blk + 1) * dev->param.chunks_per_block;
+	int chunk_id;
+	int ok = 1;
+	u32 sum = 0;
+	u8 *buffer;
+
+	if (!dev->sum_tags)
+		return 0;
+
+	buffer = yaffs_get_temp_buffer(dev, __LINE__);
+
+	for (chunk_id = 1; ok && chunk < end; chunk_id++, chunk++) {
+		int n = min(n_left, per_chunk);
+
+		yaffs_rd_chunk_tags_nand(dev, chunk, buffer, &tags);
+
+		if (!tags.chunk_used ||
+		    tags.ecc_result == YAFFS_ECC_RESULT_UNFIXED ||
+		    tags.obj_id != YAFFS_OBJECTID_SUMMARY ||
+		    tags.chunk_id != chunk_id ||
+		    tags.seq_number != bi->seq_number ||
+		    tags.n_bytes != sizeof(hdr) + n * sizeof(*st)) {
+			ok = 0;
+			break;
+		}
+
+		memcpy(&hdr, buffer, sizeof(hdr));
+		if (hdr.version != YAFFS_SUMMARY_VERSION ||
+		    hdr.block != blk || hdr.seq != bi->seq_number ||
+		    (chunk_id > 1 && hdr.sum != sum)) {
+			ok = 0;
+			break;
+		}
+		sum = hdr.sum;
+
+		memcpy(st, buffer + sizeof(hdr), n * sizeof(*st));
+		st += n;
+		n_left -= n;
+	}
+
+	yaffs_release_temp_buffer(dev, buffer, __LINE__);
+
+	if (ok && yaffs_summary_sum(dev) != sum)
+		ok = 0;
+
+	if (!ok)
+		yaffs_trace(YAFFS_TRACE_SCAN,
+			"Block %d has no valid summary", blk);
+
+	return ok;
+}
+
+/*
+ * yaffs_summary_fetch() makes up the tags of a chunk from the summary
+ * loaded by yaffs_summary_read(). The caller fills in the sequence number.
+ */
+void yaffs_summary_fetch(struct yaffs_dev *dev, struct yaffs_ext_tags *tags,
+			 int chunk_in_block)
+{
+	yaffs_init_tags(tags);
+	tags->chunk_used = 1;
+	tags->ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+
+	if (chunk_in_block >= dev->chunks_per_summary) {
+		tags->obj_id = YAFFS_OBJECTID_SUMMARY;
+		tags->chunk_id = chunk_in_block - dev->chunks_per_summary + 1;
+	} else {
+		struct yaffs_summary_tags *st = &dev->sum_tags[chunk_in_block];
+
+		tags->obj_id = st->obj_id;
+		tags->chunk_id = st->chunk_id;
+		tags->n_bytes = st->n_bytes;
+	}
+}
@@ -54,6 +54,8 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/freezer.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
 
 #include <asm/div64.h>
 
@@ -121,17 +123,92 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
+/*
+ * gross_lock is held exclusively by everything that changes the
+ * filesystem, gc and checkpointing included. Lookups, readdir and
+ * readpage only hold it shared, so they don't queue up behind each other,
+ * and serialise among themselves on the core's own dev->core_lock for
+ * the state that even reads change. Page cache and dcache hits take
+ * neither.
+ */
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 wait = 0;
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	if (!down_write_trylock(&lc->gross_lock)) {
+		u64 start = local_clock();
+
+		atomic_inc(&lc->gross_lock_waiters);
+		down_write(&lc->gross_lock);
+		atomic_dec(&lc->gross_lock_waiters);
+
+		lc->gross_lock_contended++;
+		wait = local_clock() - start;
+		/* We may have changed cpu while waiting */
+		if ((s64)wait < 0)
+			wait = 0;
+	}
+	lc->gross_lock_count++;
+	lc->gross_lock_wait_ns += wait;
+	lc->gross_lock_taken = local_clock();
+	if (current != lc->bg_thread)
+		lc->last_fg_use = jiffies;
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 held = local_clock() - lc->gross_lock_taken;
+
+	/* We may have changed cpu while holding it */
+	if ((s64)held > 0) {
+		lc->gross_lock_hold_ns += held;
+		if (held > lc->gross_lock_max_hold_ns)
+			lc->gross_lock_max_hold_ns = held;
+	}
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&lc->gross_lock);
+}
+
+/* Shared holders may only call into the core with dev->core_lock held */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	if (!down_read_trylock(&lc->gross_lock)) {
+		u64 start = local_clock();
+		u64 wait;
+
+		atomic_inc(&lc->gross_lock_waiters);
+		down_read(&lc->gross_lock);
+		atomic_dec(&lc->gross_lock_waiters);
+
+		atomic_inc(&lc->gross_lock_shared_contended);
+		wait = local_clock() - start;
+		/* We may have changed cpu while waiting */
+		if ((s64)wait > 0)
+			atomic64_add(wait, &lc->gross_lock_shared_wait_ns);
+	}
+	atomic_inc(&lc->gross_lock_shared_count);
+	lc->last_fg_use = jiffies;
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&yaffs_dev_to_lc(dev)->gross_lock);
+}
+
+/* Is anybody queued up behind the current gross_lock holder? */
+static int yaffs_gross_lock_waiters(struct yaffs_dev *dev)
+{
+	return atomic_read(&yaffs_dev_to_lc(dev)->gross_lock_waiters);
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -156,13 +233,15 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
+	mutex_lock(&dev->core_lock);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	mutex_unlock(&dev->core_lock);
+	yaffs_gross_unlock_shared(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -373,8 +452,11 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+	/* readdir drops gross_lock around filldir, so a lookup made from
+	 * there has to take it like any other.
+	 */
+	yaffs_gross_lock_shared(dev);
+	mutex_lock(&dev->core_lock);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
@@ -385,8 +467,8 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+	mutex_unlock(&dev->core_lock);
+	yaffs_gross_unlock_shared(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -697,7 +779,8 @@ static const struct inode_operations yaffs_dir_inode_operations = {
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked, either
+ * exclusively or shared with core_lock held.
  */
 
 struct yaffs_search_context {
@@ -795,6 +878,23 @@ static void yaffs_remove_obj_callback(struct yaffs_obj *obj)
 
 }
 
+/*
+ * readdir holds gross_lock shared, and core_lock for the search context
+ * list and the core, but drops both around filldir: that may fault, or
+ * call back into yaffs_lookup().
+ */
+static void yaffs_readdir_lock(struct yaffs_dev *dev)
+{
+	yaffs_gross_lock_shared(dev);
+	mutex_lock(&dev->core_lock);
+}
+
+static void yaffs_readdir_unlock(struct yaffs_dev *dev)
+{
+	mutex_unlock(&dev->core_lock);
+	yaffs_gross_unlock_shared(dev);
+}
+
 static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 {
 	struct yaffs_obj *obj;
@@ -810,9 +910,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
-
-	yaffs_dev_to_lc(dev)->readdir_process = current;
+	yaffs_readdir_lock(dev);
 
 	offset = f->f_pos;
 
@@ -829,12 +927,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_readdir_unlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_readdir_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -842,14 +940,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_readdir_unlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_readdir_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -876,17 +974,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_readdir_unlock(dev);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_readdir_lock(dev);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -896,8 +994,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 
 out:
 	yaffs_search_end(sc);
-	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_readdir_unlock(dev);
 
 	return ret_val;
 }
@@ -1149,12 +1246,15 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	/* yaffs_file_rd() takes core_lock itself, but drops it for
+	 * whole chunk NAND reads.
+	 */
+	yaffs_gross_lock_shared(dev);
 
 	ret = yaffs_file_rd(obj, pg_buf,
 			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1542,10 +1642,27 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 	yaffs_flush_inodes(sb);
 	yaffs_update_dirty_dirs(dev);
 	yaffs_flush_whole_cache(dev);
-	if (do_checkpoint)
+	if (do_checkpoint) {
+		struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+		int was_checkpointed = dev->is_checkpointed;
+		ktime_t start = ktime_get();
+
 		yaffs_checkpoint_save(dev);
+
+		/* Only count saves that actually wrote something */
+		if (!was_checkpointed) {
+			lc->checkpt_saves++;
+			lc->checkpt_save_us =
+			    ktime_us_delta(ktime_get(), start);
+			if (lc->checkpt_save_us > lc->checkpt_save_max_us)
+				lc->checkpt_save_max_us = lc->checkpt_save_us;
+		}
+	}
 }
 
+/* Erased blocks above the reserve below which background gc is urgent */
+#define YAFFS_BG_LOW_WATER	2
+
 static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 {
 	unsigned erased_chunks =
@@ -1558,6 +1675,11 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 
 	if (!context->bg_running)
 		return 0;
+	else if (scattered < dev->param.chunks_per_block)
+		return 0;
+	else if (dev->n_erased_blocks <=
+		 dev->param.n_reserved_blocks + YAFFS_BG_LOW_WATER)
+		return 2;	/* Writers are about to hit foreground gc */
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
 	else if (erased_chunks > dev->n_free_chunks / 2)
@@ -1610,11 +1732,54 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
  * The thread should not do any writing while the fs is in read only.
  */
 
+/*
+ * When nobody else has used the device for a while the background thread
+ * does up to YAFFS_BG_IDLE_PASSES gc passes per wake up, so that writers
+ * find erased blocks waiting for them instead of having to gc themselves.
+ */
+#define YAFFS_BG_IDLE_PASSES	8
+#define YAFFS_BG_IDLE_JIFFIES	HZ
+
+static int yaffs_bg_idle(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
+	return time_after(jiffies,
+			  context->last_fg_use + YAFFS_BG_IDLE_JIFFIES) &&
+	    !yaffs_gross_lock_waiters(dev);
+}
+
 void yaffs_background_waker(unsigned long data)
 {
 	wake_up_process((struct task_struct *)data);
 }
 
+/*
+ * Keep collecting while the device stays idle and free space is scattered.
+ * The gross_lock, which the caller holds, is dropped between passes.
+ */
+static int yaffs_bg_gc_idle(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+	unsigned urgency;
+	int gc_result = 0;
+	int i;
+
+	for (i = 0; i < YAFFS_BG_IDLE_PASSES && !gc_result; i++) {
+		yaffs_gross_unlock(dev);
+		cond_resched();
+		yaffs_gross_lock(dev);
+
+		urgency = yaffs_bg_gc_urgency(dev);
+		if (dev->is_checkpointed || !urgency || !yaffs_bg_idle(dev))
+			break;
+		gc_result = yaffs_bg_gc(dev, urgency);
+		context->bg_gc_idle_passes++;
+	}
+
+	return gc_result;
+}
+
 static int yaffs_bg_thread_fn(void *data)
 {
 	struct yaffs_dev *dev = (struct yaffs_dev *)data;
@@ -1641,25 +1806,39 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 
-		yaffs_gross_lock(dev);
-
 		now = jiffies;
 
+		/* Directory updates and gc are done under separate lock
+		 * holds so that foreground users can get in between.
+		 */
 		if (time_after(now, next_dir_update) && yaffs_bg_enable) {
+			yaffs_gross_lock(dev);
 			yaffs_update_dirty_dirs(dev);
+			yaffs_gross_unlock(dev);
 			next_dir_update = now + HZ;
+			cond_resched();
 		}
 
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
+			yaffs_gross_lock(dev);
 			if (!dev->is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
-				gc_result = yaffs_bg_gc(dev, urgency);
-				if (urgency > 1)
+				if (urgency < 2 && yaffs_gross_lock_waiters(dev)) {
+					/* Not pressing, let the waiters go first */
+					context->bg_gc_yields++;
 					next_gc = now + HZ / 20 + 1;
-				else if (urgency > 0)
-					next_gc = now + HZ / 10 + 1;
-				else
-					next_gc = now + HZ * 2;
+				} else {
+					gc_result = yaffs_bg_gc(dev, urgency);
+					if (urgency > 0 && !gc_result &&
+					    yaffs_bg_idle(dev))
+						gc_result = yaffs_bg_gc_idle(dev);
+					if (urgency > 1)
+						next_gc = now + HZ / 20 + 1;
+					else if (urgency > 0)
+						next_gc = now + HZ / 10 + 1;
+					else
+						next_gc = now + HZ * 2;
+				}
 			} else	{
 			        /*
 				 * gc not running so set to next_dir_update
@@ -1667,8 +1846,8 @@ static int yaffs_bg_thread_fn(void *data)
 				 */
 				next_gc = next_dir_update;
                         }
+			yaffs_gross_unlock(dev);
 		}
-		yaffs_gross_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
@@ -1758,12 +1937,14 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;		/* 0 means use the default */
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int no_summary;
 };
 
 #define MAX_OPT_LEN 30
@@ -1813,6 +1994,20 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache=", 6)) {
+			char *end;
+
+			options->n_caches =
+			    simple_strtoul(cur_opt + 6, &end, 0);
+			if (*end || options->n_caches < 1 ||
+			    options->n_caches > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+				       "yaffs: Bad cache size \"%s\"\n",
+				       cur_opt);
+				error = 1;
+			}
+		} else if (!strcmp(cur_opt, "no-summary")) {
+			options->no_summary = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2017,6 +2212,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	char devname_buf[BDEVNAME_SIZE + 1];
 	struct mtd_info *mtd;
 	int err;
+	ktime_t mount_start;
 	char *data_str = (char *)data;
 	struct yaffs_linux_context *context = NULL;
 	struct yaffs_param *param;
@@ -2215,7 +2411,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.n_caches)
+		param->n_caches = options.n_caches;
+	else
+		param->n_caches = 10;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2295,6 +2496,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 #endif
 
 	param->skip_checkpt_rd = options.skip_checkpoint_read;
+	param->disable_summary = options.no_summary;
 	param->skip_checkpt_wr = options.skip_checkpoint_write;
 
 	mutex_lock(&yaffs_context_lock);
@@ -2320,11 +2522,18 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
+	atomic_set(&(yaffs_dev_to_lc(dev)->gross_lock_waiters), 0);
+	atomic_set(&(yaffs_dev_to_lc(dev)->gross_lock_shared_count), 0);
+	atomic_set(&(yaffs_dev_to_lc(dev)->gross_lock_shared_contended), 0);
+	atomic64_set(&(yaffs_dev_to_lc(dev)->gross_lock_shared_wait_ns), 0);
 
 	yaffs_gross_lock(dev);
 
+	mount_start = ktime_get();
 	err = yaffs_guts_initialise(dev);
+	context->mount_us = ktime_us_delta(ktime_get(), mount_start);
+	context->mount_from_checkpt = dev->is_checkpointed;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_super: guts initialised %s",
@@ -2440,6 +2649,8 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_caches.............. %d\n", param->n_caches);
 	buf += sprintf(buf, "n_reserved_blocks..... %d\n",
 			param->n_reserved_blocks);
+	buf += sprintf(buf, "disable_summary....... %d\n",
+			param->disable_summary);
 	buf += sprintf(buf, "always_check_erased... %d\n",
 			param->always_check_erased);
 
@@ -2448,6 +2659,8 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2486,12 +2699,60 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf += sprintf(buf, "cache_writebacks...... %u\n",
+		       dev->cache_writebacks);
+	buf += sprintf(buf, "cache_coalesced....... %u\n",
+		       dev->cache_coalesced);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
 	    sprintf(buf, "n_unlinked_files...... %u\n", dev->n_unlinked_files);
 	buf += sprintf(buf, "refresh_count......... %u\n", dev->refresh_count);
 	buf += sprintf(buf, "n_bg_deletions........ %u\n", dev->n_bg_deletions);
+	buf +=
+	    sprintf(buf, "n_summary_scans....... %u\n", dev->n_summary_scans);
+	buf += sprintf(buf, "n_full_scans.......... %u\n", dev->n_full_scans);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "gross_lock_count...... %u\n", lc->gross_lock_count);
+	buf +=
+	    sprintf(buf, "gross_lock_contended.. %u\n",
+		    lc->gross_lock_contended);
+	buf +=
+	    sprintf(buf, "gross_lock_wait_us.... %llu\n",
+		    div_u64(lc->gross_lock_wait_ns, NSEC_PER_USEC));
+	buf +=
+	    sprintf(buf, "gross_lock_hold_us.... %llu\n",
+		    div_u64(lc->gross_lock_hold_ns, NSEC_PER_USEC));
+	buf +=
+	    sprintf(buf, "gross_lock_max_hold_us %llu\n",
+		    div_u64(lc->gross_lock_max_hold_ns, NSEC_PER_USEC));
+	buf +=
+	    sprintf(buf, "shared_lock_count..... %u\n",
+		    atomic_read(&lc->gross_lock_shared_count));
+	buf +=
+	    sprintf(buf, "shared_lock_contended. %u\n",
+		    atomic_read(&lc->gross_lock_shared_contended));
+	buf +=
+	    sprintf(buf, "shared_lock_wait_us... %llu\n",
+		    div_u64(atomic64_read(&lc->gross_lock_shared_wait_ns),
+			    NSEC_PER_USEC));
+	buf += sprintf(buf, "bg_gc_yields.......... %u\n", lc->bg_gc_yields);
+	buf += sprintf(buf, "bg_gc_idle_passes..... %u\n",
+		       lc->bg_gc_idle_passes);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "mount_us.............. %u\n", lc->mount_us);
+	buf +=
+	    sprintf(buf, "mount_from_checkpt.... %d\n", lc->mount_from_checkpt);
+	buf += sprintf(buf, "checkpt_saves......... %u\n", lc->checkpt_saves);
+	buf +=
+	    sprintf(buf, "checkpt_save_us....... %u\n", lc->checkpt_save_us);
+	buf +=
+	    sprintf(buf, "checkpt_save_max_us... %u\n",
+		    lc->checkpt_save_max_us);
+	buf +=
+	    sprintf(buf, "checkpt_byte_count.... %d\n",
+		    dev->checkpt_byte_count);
 
 	return buf;
 }
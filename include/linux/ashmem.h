@@ -32,6 +32,30 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/* ashmem_pin_range.flags: unpin rather than pin this range */
+#define ASHMEM_PIN_RANGE_UNPIN	0x1
+
+struct ashmem_pin_range {
+	__u32 offset;	/* as in struct ashmem_pin */
+	__u32 len;
+	__u32 flags;	/* ASHMEM_PIN_RANGE_* */
+	__u32 purged;	/* out: ASHMEM_WAS_PURGED or ASHMEM_NOT_PURGED */
+};
+
+/* Most ranges a single ASHMEM_PIN_BATCH may carry */
+#define ASHMEM_PIN_BATCH_MAX	256
+
+/*
+ * ASHMEM_PIN_BATCH pins and unpins 'nr' ranges in order, under a single
+ * lock acquisition. On return 'nr' holds the number of ranges applied,
+ * which is less than requested only if an error is returned.
+ */
+struct ashmem_pin_batch {
+	__u32 nr;
+	__u32 reserved;	/* must be zero */
+	struct ashmem_pin_range ranges[0];
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -47,6 +71,7 @@ struct ashmem_pin {
 #define ASHMEM_CACHE_FLUSH_RANGE	_IO(__ASHMEMIOC, 11)
 #define ASHMEM_CACHE_CLEAN_RANGE	_IO(__ASHMEMIOC, 12)
 #define ASHMEM_CACHE_INV_RANGE		_IO(__ASHMEMIOC, 13)
+#define ASHMEM_PIN_BATCH	_IOWR(__ASHMEMIOC, 14, struct ashmem_pin_batch)
 
 int get_ashmem_file(int fd, struct file **filp, struct file **vm_file,
 			unsigned long *len);
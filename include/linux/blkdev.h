@@ -120,6 +120,10 @@ struct request {
 #ifdef CONFIG_BLK_CGROUP
 	unsigned long long start_time_ns;
 	unsigned long long io_start_time_ns;    /* when passed to hardware */
+#endif
+#ifdef CONFIG_BLK_DEV_LATENCY_STATS
+	u64 lat_start_ns;		/* allocated, 0 if not accounted */
+	u64 lat_dispatch_ns;		/* handed to the driver */
 #endif
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
@@ -379,6 +383,11 @@ struct request_queue
 	/* Throttle data */
 	struct throtl_data *td;
 #endif
+
+#ifdef CONFIG_BLK_DEV_LATENCY_STATS
+	/* Latency histograms, NULL unless enabled */
+	struct blk_latency_stats *latency_stats;
+#endif
 };
 
 #define QUEUE_FLAG_QUEUED	1	/* uses generic tag queueing */
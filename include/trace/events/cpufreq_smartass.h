@@ -0,0 +1,77 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpufreq_smartass
+
+#if !defined(_TRACE_CPUFREQ_SMARTASS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CPUFREQ_SMARTASS_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cpufreq_smartass_target,
+	TP_PROTO(unsigned int cpu, unsigned int old_freq,
+		 unsigned int new_freq, unsigned int target),
+	TP_ARGS(cpu, old_freq, new_freq, target),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cpu)
+		__field(unsigned int, old_freq)
+		__field(unsigned int, new_freq)
+		__field(unsigned int, target)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->old_freq = old_freq;
+		__entry->new_freq = new_freq;
+		__entry->target = target;
+	),
+
+	TP_printk("cpu=%u old=%u new=%u target=%u",
+		  __entry->cpu, __entry->old_freq, __entry->new_freq,
+		  __entry->target)
+);
+
+TRACE_EVENT(cpufreq_smartass_input,
+	TP_PROTO(unsigned int type, unsigned int code),
+	TP_ARGS(type, code),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, type)
+		__field(unsigned int, code)
+	),
+
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->code = code;
+	),
+
+	TP_printk("type=%u code=%u", __entry->type, __entry->code)
+);
+
+TRACE_EVENT(cpufreq_smartass_boost,
+	TP_PROTO(unsigned int cpu, unsigned int old_freq,
+		 unsigned int new_freq, s64 latency_us),
+	TP_ARGS(cpu, old_freq, new_freq, latency_us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cpu)
+		__field(unsigned int, old_freq)
+		__field(unsigned int, new_freq)
+		__field(s64, latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->old_freq = old_freq;
+		__entry->new_freq = new_freq;
+		__entry->latency_us = latency_us;
+	),
+
+	TP_printk("cpu=%u old=%u new=%u input_latency_us=%lld",
+		  __entry->cpu, __entry->old_freq, __entry->new_freq,
+		  __entry->latency_us)
+);
+
+#endif /* _TRACE_CPUFREQ_SMARTASS_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -38,12 +38,15 @@
 
 /*
  * ashmem_area - anonymous shared memory area
- * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Lifecycle: From our parent file's open() until its release(), and for
+ *	as long as the shrinker holds a reference on it
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
+	struct mutex mutex;		/* protects this area and its ranges */
+	atomic_t refcount;		/* the file, plus shrinker users */
 	struct list_head unpinned_list;	/* list of all ashmem areas */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
@@ -55,7 +58,7 @@ struct ashmem_area {
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -66,18 +69,30 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages and of ranges on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
+static unsigned long lru_ranges;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and counters
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/*
+ * Statistics, protected by ashmem_lru_lock: pages purged by the shrinker,
+ * and shrinker calls or ranges it had to skip (because of gfp_mask, or
+ * because the range's area was busy).
+ */
+static unsigned long ashmem_purged_pages;
+static unsigned long ashmem_shrink_skips;
+module_param_named(purged_pages, ashmem_purged_pages, ulong, S_IRUGO);
+module_param_named(shrink_skips, ashmem_shrink_skips, ulong, S_IRUGO);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -108,14 +123,37 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	lru_ranges++;
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock. */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	lru_ranges--;
+}
+
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+static inline void asma_get(struct ashmem_area *asma)
+{
+	atomic_inc(&asma->refcount);
+}
+
+static inline void asma_put(struct ashmem_area *asma)
+{
+	if (atomic_dec_and_test(&asma->refcount))
+		kmem_cache_free(ashmem_area_cachep, asma);
 }
 
 /*
@@ -127,7 +165,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -163,18 +201,22 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
 	size_t pre = range_size(range);
 
+	/* The shrinker reads pgstart/pgend under asma->mutex only */
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -190,6 +232,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->refcount, 1);
 	INIT_LIST_HEAD(&asma->unpinned_list);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
@@ -203,14 +247,14 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
-	kmem_cache_free(ashmem_area_cachep, asma);
+	asma_put(asma);
 
 	return 0;
 }
@@ -221,7 +265,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -242,7 +286,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -251,7 +295,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -272,7 +316,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -290,14 +334,14 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	int ret = 0, count = 1000;
 
 	while (1) {
-		if (mutex_trylock(&ashmem_mutex)) {
-			/* pr_err("%s: ashmem_mutex obtained with %d!\n", __func__, count); */
+		if (mutex_trylock(&asma->mutex)) {
+			/* pr_err("%s: asma->mutex obtained with %d!\n", __func__, count); */
 			break;
 		}
 		if (--count == 0) {
 			ret = -EBUSY;
-			WARN(1, KERN_ERR "%s: FAILED to lock ashmem_mutex\n", __func__);
-			goto out;
+			WARN(1, KERN_ERR "%s: FAILED to lock asma->mutex\n", __func__);
+			goto out_unlocked;
 		}
 		msleep(1);
 	};
@@ -344,10 +388,24 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
+out_unlocked:
 	return ret;
 }
 
+/* Is 'range' still one of asma's unpinned ranges? Caller holds asma->mutex. */
+static bool range_is_unpinned(struct ashmem_area *asma,
+			      struct ashmem_range *range)
+{
+	struct ashmem_range *r;
+
+	list_for_each_entry(r, &asma->unpinned_list, unpinned)
+		if (r == range)
+			return true;
+
+	return false;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -361,36 +419,70 @@ out:
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * pages freed. A range whose area is busy (its mutex may even be held by
+ * the task that got us here) is rotated to the tail of the LRU and skipped;
+ * we try every range on the LRU at most once per call.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	unsigned long nr_tries;
+	int ret;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
-	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+	if (nr_to_scan && !(gfp_mask & __GFP_FS)) {
+		spin_lock(&ashmem_lru_lock);
+		ashmem_shrink_skips++;
+		spin_unlock(&ashmem_lru_lock);
 		return -1;
+	}
 	if (!nr_to_scan)
 		return lru_count;
 
-	if (!mutex_trylock(&ashmem_mutex))
-		return -1;
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	nr_tries = lru_ranges;
+	while (nr_to_scan > 0 && nr_tries-- && !list_empty(&ashmem_lru_list)) {
+		struct ashmem_area *asma;
+
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		list_move_tail(&range->lru, &ashmem_lru_list);
+		asma = range->asma;
+		asma_get(asma);
+		spin_unlock(&ashmem_lru_lock);
+
+		if (!mutex_trylock(&asma->mutex)) {
+			asma_put(asma);
+			spin_lock(&ashmem_lru_lock);
+			ashmem_shrink_skips++;
+			continue;
+		}
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		/* The range may have been pinned since we dropped the lock */
+		if (range_is_unpinned(asma, range) && range_on_lru(range)) {
+			struct inode *inode = asma->file->f_dentry->d_inode;
+			loff_t start = range->pgstart * PAGE_SIZE;
+			loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+			vmtruncate_range(inode, start, end);
+
+			spin_lock(&ashmem_lru_lock);
+			range->purged = ASHMEM_WAS_PURGED;
+			__lru_del(range);
+			ashmem_purged_pages += range_size(range);
+			spin_unlock(&ashmem_lru_lock);
+
+			nr_to_scan -= range_size(range);
+		}
+		mutex_unlock(&asma->mutex);
+		asma_put(asma);
+
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	ret = lru_count;
+	spin_unlock(&ashmem_lru_lock);
 
-	return lru_count;
+	return ret;
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -402,7 +494,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -417,7 +509,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -425,7 +517,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -439,7 +531,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -448,7 +540,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -465,7 +557,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -474,7 +566,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -540,7 +632,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -575,7 +667,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -595,6 +687,32 @@ static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 	return ret;
 }
 
+/*
+ * ashmem_pin_check - validate a user-supplied byte range and convert it to
+ * the inclusive page interval [*pgstart, *pgend]. Returns zero on success.
+ */
+static int ashmem_pin_check(struct ashmem_area *asma, __u32 offset, __u32 len,
+			    size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!len)
+		len = PAGE_ALIGN(asma->size) - offset;
+
+	if (unlikely((offset | len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - offset < len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < offset + len))
+		return -EINVAL;
+
+	*pgstart = offset / PAGE_SIZE;
+	*pgend = *pgstart + (len / PAGE_SIZE) - 1;
+
+	return 0;
+}
+
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
@@ -608,23 +726,11 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
-		return -EINVAL;
-
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
+	ret = ashmem_pin_check(asma, pin.offset, pin.len, &pgstart, &pgend);
+	if (ret)
+		return ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -638,8 +744,82 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
+
+	return ret;
+}
+
+/*
+ * ashmem_pin_batch - apply a vector of pins and unpins in one go
+ *
+ * The whole vector is copied in, validated up front (so a bad range fails
+ * the call before anything is applied), applied in order under a single
+ * hold of asma->mutex, and the per-range purged status copied back out.
+ */
+static int ashmem_pin_batch(struct ashmem_area *asma,
+			    struct ashmem_pin_batch __user *p)
+{
+	struct ashmem_pin_batch batch;
+	struct ashmem_pin_range *ranges;
+	size_t *pages;
+	size_t bytes;
+	__u32 i;
+	int ret = 0;
+
+	if (unlikely(!asma->file))
+		return -EINVAL;
+
+	if (unlikely(copy_from_user(&batch, p, sizeof(batch))))
+		return -EFAULT;
+
+	if (unlikely(batch.reserved || batch.nr > ASHMEM_PIN_BATCH_MAX))
+		return -EINVAL;
+	if (!batch.nr)
+		return 0;
+
+	bytes = batch.nr * sizeof(*ranges);
+	ranges = kmalloc(bytes + batch.nr * 2 * sizeof(*pages), GFP_KERNEL);
+	if (unlikely(!ranges))
+		return -ENOMEM;
+	pages = (size_t *)(ranges + batch.nr);
+
+	if (unlikely(copy_from_user(ranges, p->ranges, bytes))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.nr; i++) {
+		if (unlikely(ranges[i].flags & ~ASHMEM_PIN_RANGE_UNPIN)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		ret = ashmem_pin_check(asma, ranges[i].offset, ranges[i].len,
+				       &pages[2 * i], &pages[2 * i + 1]);
+		if (ret)
+			goto out;
+	}
 
+	mutex_lock(&asma->mutex);
+	for (i = 0; i < batch.nr; i++) {
+		size_t pgstart = pages[2 * i], pgend = pages[2 * i + 1];
+
+		ranges[i].purged = ASHMEM_NOT_PURGED;
+		if (ranges[i].flags & ASHMEM_PIN_RANGE_UNPIN) {
+			ret = ashmem_unpin(asma, pgstart, pgend);
+			if (ret)
+				break;
+		} else
+			ranges[i].purged = ashmem_pin(asma, pgstart, pgend);
+	}
+	mutex_unlock(&asma->mutex);
+
+	batch.nr = i;
+	if (unlikely(copy_to_user(p->ranges, ranges, i * sizeof(*ranges)) ||
+		     put_user(batch.nr, &p->nr)))
+		ret = -EFAULT;
+
+out:
+	kfree(ranges);
 	return ret;
 }
 
@@ -760,6 +940,9 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_BATCH:
+		ret = ashmem_pin_batch(asma, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
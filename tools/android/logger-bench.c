@@ -0,0 +1,193 @@
+/*
+ * logger-bench.c -- hammer an Android logger device with writev()
+ *
+ * Starts N writer threads that each log a number of entries the way
+ * liblog does (priority byte, tag, message, as three iovecs) and reports
+ * the aggregate write rate. With -r a reader drains the log at the same
+ * time, like logcat, to show writer/reader interference.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o logger-bench logger-bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define LOGGER_ENTRY_MAX_LEN	(4*1024)
+
+static const char *dev = "/dev/log/main";
+static int nr_threads = 4;
+static long nr_entries = 100000;
+static size_t msg_len = 64;
+static int with_reader;
+static volatile int stop_reader;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *writer(void *arg)
+{
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	char tag[32];
+	char *msg;
+	struct iovec vec[3];
+	long i;
+	int fd;
+
+	fd = open(dev, O_WRONLY);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+
+	snprintf(tag, sizeof(tag), "bench%ld", (long)arg);
+	msg = malloc(msg_len + 1);
+	if (!msg) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_len);
+	msg[msg_len] = '\0';
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = tag;
+	vec[1].iov_len = strlen(tag) + 1;
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_len + 1;
+
+	for (i = 0; i < nr_entries; i++) {
+		if (writev(fd, vec, 3) < 0 && errno != EINTR) {
+			perror("writev");
+			exit(1);
+		}
+	}
+
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	static char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	long *entries = arg;
+	int fd;
+
+	fd = open(dev, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+
+	while (!stop_reader) {
+		if (read(fd, buf, sizeof(buf)) > 0)
+			(*entries)++;
+		else if (errno == EAGAIN)
+			usleep(1000);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t threads] [-n entries] [-s size] [-r]\n"
+		"  -d  logger device (default %s)\n"
+		"  -t  writer threads (default %d)\n"
+		"  -n  entries per thread (default %ld)\n"
+		"  -s  message length in bytes (default %zu)\n"
+		"  -r  drain the log from a reader thread meanwhile\n",
+		prog, dev, nr_threads, nr_entries, msg_len);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads, rthread;
+	long read_entries = 0;
+	double start, elapsed;
+	long i;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:t:n:s:r")) != -1) {
+		switch (c) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_entries = atol(optarg);
+			break;
+		case 's':
+			msg_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			with_reader = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads < 1 || nr_entries < 1 ||
+	    msg_len + 40 > LOGGER_ENTRY_MAX_LEN)
+		usage(argv[0]);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (with_reader &&
+	    pthread_create(&rthread, NULL, reader, &read_entries)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, writer, (void *)i)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+
+	if (with_reader) {
+		stop_reader = 1;
+		pthread_join(rthread, NULL);
+	}
+
+	printf("%d threads x %ld entries of %zu bytes in %.3f s\n",
+	       nr_threads, nr_entries, msg_len, elapsed);
+	printf("%.0f entries/s, %.2f us/entry per thread\n",
+	       nr_threads * nr_entries / elapsed,
+	       elapsed * 1e6 / nr_entries);
+	if (with_reader)
+		printf("reader drained %ld entries\n", read_entries);
+
+	free(threads);
+	return 0;
+}
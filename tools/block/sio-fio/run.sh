@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# run.sh -- compare sio (fifo and sorted) with deadline and cfq using fio
+#
+# Runs every *.fio job in this directory once per scheduler setup on a
+# block device, which can be an mmc device or a loop device (for
+# example losetup /dev/loop0 on a file on eMMC). The jobs write to a
+# file on a scratch filesystem created on the device: ALL DATA ON IT IS
+# LOST.
+#
+# usage: run.sh <block device>
+
+set -e
+
+DEV=$1
+if [ ! -b "$DEV" ]; then
+	echo "usage: $0 <block device>" >&2
+	exit 2
+fi
+
+DIR=$(cd $(dirname "$0") && pwd)
+NAME=$(basename $(readlink -f $DEV))
+Q=/sys/block/$NAME/queue
+MNT=${TMPDIR:-/tmp}/sio-fio.$$
+OUT=$DIR/results-$(date +%Y%m%d-%H%M%S)
+
+mkdir -p $MNT $OUT
+mkfs.ext4 -q $DEV
+mount $DEV $MNT
+trap "umount $MNT; rmdir $MNT" EXIT
+
+for setup in sio sio-sorted deadline cfq; do
+	case $setup in
+	sio-sorted)
+		echo sio > $Q/scheduler
+		echo 1 > $Q/iosched/sorted
+		;;
+	sio)
+		echo sio > $Q/scheduler
+		echo 0 > $Q/iosched/sorted
+		;;
+	*)
+		echo $setup > $Q/scheduler
+		;;
+	esac
+
+	for job in $DIR/*.fio; do
+		base=$(basename $job .fio)
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+		fio --directory=$MNT --output=$OUT/$setup-$base.txt $job
+		rm -f $MNT/*
+	done
+	echo "$setup done"
+done
+
+echo "results in $OUT"
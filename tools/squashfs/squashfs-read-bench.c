@@ -0,0 +1,178 @@
+/*
+ * squashfs-read-bench.c -- parallel readers over a mounted filesystem
+ *
+ * Walks a directory tree and has N threads read every regular file in
+ * it, each thread taking the next file from a shared list. The page
+ * cache is dropped first (unless -k is given), so that on squashfs every
+ * read goes through decompression. The aggregate read rate is printed.
+ *
+ * See squashfs-read-bench.sh for comparing the threads= mount modes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o squashfs-read-bench squashfs-read-bench.c -lpthread */
+
+#define _XOPEN_SOURCE 500	/* nftw */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BUF_SIZE	(128 * 1024)
+
+static char **files;
+static int nr_files, max_files;
+static int next_file;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long total_bytes;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+
+	if (type != FTW_F)
+		return 0;
+	if (nr_files == max_files) {
+		max_files = max_files ? max_files * 2 : 1024;
+		files = realloc(files, max_files * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	files[nr_files++] = strdup(path);
+	return 0;
+}
+
+static void *reader(void *arg)
+{
+	unsigned long long bytes = 0;
+	char *buf;
+	ssize_t n;
+	int i, fd;
+
+	(void)arg;
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&next_lock);
+		i = next_file++;
+		pthread_mutex_unlock(&next_lock);
+		if (i >= nr_files)
+			break;
+
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0) {
+			perror(files[i]);
+			continue;
+		}
+		while ((n = read(fd, buf, BUF_SIZE)) > 0)
+			bytes += n;
+		if (n < 0)
+			perror(files[i]);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&next_lock);
+	total_bytes += bytes;
+	pthread_mutex_unlock(&next_lock);
+	free(buf);
+	return NULL;
+}
+
+static void drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1) {
+		perror("drop_caches");
+		exit(1);
+	}
+	close(fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-k] dir\n"
+		"  -t  reader threads (default: number of online cpus)\n"
+		"  -k  keep the page cache, don't drop it first\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int keep_cache = 0;
+	pthread_t *threads;
+	double start, elapsed;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "t:k")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'k':
+			keep_cache = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1)
+		usage(argv[0]);
+
+	if (nftw(argv[optind], add_file, 32, FTW_PHYS)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!keep_cache)
+		drop_caches();
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, reader, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+
+	printf("%d threads: %d files, %llu bytes in %.3f s, %.1f MB/s\n",
+	       nr_threads, nr_files, total_bytes, elapsed,
+	       total_bytes / 1048576.0 / elapsed);
+	return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# squashfs-read-bench.sh -- compare squashfs threads= modes
+#
+# Builds a squashfs image of a source directory (or uses an existing
+# image), loop-mounts it once per threads= mode, and runs
+# squashfs-read-bench with 1 reader and with N readers against it.
+#
+# Needs root, mksquashfs (unless an image is given) and a kernel with
+# this squashfs.
+#
+# usage: squashfs-read-bench.sh <source dir | image.sqsh> [readers]
+
+set -e
+
+SRC=$1
+READERS=${2:-$(getconf _NPROCESSORS_ONLN)}
+BENCH=$(dirname "$0")/squashfs-read-bench
+TMP=${TMPDIR:-/tmp}/sqfs-bench.$$
+
+if [ -z "$SRC" ]; then
+	echo "usage: $0 <source dir | image.sqsh> [readers]" >&2
+	exit 2
+fi
+
+cleanup()
+{
+	umount $TMP/mnt 2>/dev/null || true
+	rm -rf $TMP
+}
+trap cleanup EXIT
+
+mkdir -p $TMP/mnt
+if [ -d "$SRC" ]; then
+	IMG=$TMP/image.sqsh
+	mksquashfs "$SRC" $IMG -noappend >/dev/null
+else
+	IMG=$SRC
+fi
+
+if [ ! -x "$BENCH" ]; then
+	cc -Wall -O2 -o $TMP/bench "$BENCH.c" -lpthread
+	BENCH=$TMP/bench
+fi
+
+for mode in single multi percpu; do
+	mount -t squashfs -o loop,ro,threads=$mode $IMG $TMP/mnt
+	echo "threads=$mode"
+	for n in 1 $READERS; do
+		printf "  "
+		$BENCH -t $n $TMP/mnt
+	done
+	umount $TMP/mnt
+done
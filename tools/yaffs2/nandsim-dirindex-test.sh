@@ -0,0 +1,139 @@
+#!/bin/sh
+#
+# nandsim-dirindex-test.sh -- exercise yaffs2 directory name lookups
+#
+# Creates a directory with many more entries than it takes to build a
+# directory's name index (YAFFS_DIR_INDEX_MIN_CHILDREN, 32), including
+# anagram names, whose name sums collide. It then renames and unlinks a
+# share of them, both within the directory and across directories.
+# After each step, and after remounting from the checkpoint, with a
+# summary scan and with a full scan, every expected name must be found
+# by lookup, every removed one must be gone, and readdir must list
+# exactly the expected set.
+#
+# Needs root and a kernel with yaffs2, nandsim and mtdblock.
+#
+# usage: nandsim-dirindex-test.sh [entries]
+
+set -e
+
+N=${1:-1000}
+NANDSIM_ARGS=${NANDSIM_ARGS:-"first_id_byte=0x20 second_id_byte=0xaa"}
+MNT=${TMPDIR:-/tmp}/yaffs-dirindex.$$
+EXPECT=${TMPDIR:-/tmp}/yaffs-dirindex.$$.expect
+GONE=${TMPDIR:-/tmp}/yaffs-dirindex.$$.gone
+
+cleanup()
+{
+	umount $MNT 2>/dev/null || true
+	rmdir $MNT 2>/dev/null || true
+	rm -f $EXPECT $GONE
+	rmmod nandsim 2>/dev/null || true
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+# Check $MNT/big against the expected and removed name lists
+check()
+{
+	while read name; do
+		[ -e "$MNT/big/$name" ] || fail "$1: $name not found"
+	done < $EXPECT
+	while read name; do
+		[ ! -e "$MNT/big/$name" ] || fail "$1: $name still there"
+	done < $GONE
+	ls -A $MNT/big | sort > $EXPECT.ls
+	sort $EXPECT | cmp -s - $EXPECT.ls || fail "$1: readdir differs"
+	rm -f $EXPECT.ls
+	echo "ok: $1"
+}
+
+remount()
+{
+	umount $MNT
+	mount -t yaffs2 $1 $DEV $MNT
+}
+
+modprobe nandsim $NANDSIM_ARGS
+MTD=$(sed -n 's/^mtd\([0-9]*\):.*"NAND simulator.*/\1/p' /proc/mtd | head -n 1)
+[ -n "$MTD" ] || fail "nandsim did not register an mtd device"
+DEV=/dev/mtdblock$MTD
+mkdir -p $MNT
+mount -t yaffs2 $DEV $MNT
+mkdir $MNT/big $MNT/other
+: > $EXPECT
+: > $GONE
+
+i=0
+while [ $i -lt $N ]; do
+	echo $i > $MNT/big/file$i
+	echo file$i >> $EXPECT
+	i=$((i + 1))
+done
+# Anagrams have the same name sum
+for name in abcd abdc acbd adcb bacd dcba; do
+	mkdir $MNT/big/$name
+	echo $name >> $EXPECT
+done
+check create
+
+# Rename within the directory, into it and out of it
+i=0
+while [ $i -lt $N ]; do
+	mv $MNT/big/file$i $MNT/big/renamed$i
+	sed -i "/^file$i\$/d" $EXPECT
+	echo renamed$i >> $EXPECT
+	echo file$i >> $GONE
+	i=$((i + 5))
+done
+i=1
+while [ $i -lt $N ]; do
+	if [ -e $MNT/big/file$i ]; then
+		mv $MNT/big/file$i $MNT/other/file$i
+		sed -i "/^file$i\$/d" $EXPECT
+		echo file$i >> $GONE
+	fi
+	i=$((i + 11))
+done
+echo moved > $MNT/other/incoming
+mv $MNT/other/incoming $MNT/big/incoming
+echo incoming >> $EXPECT
+mv $MNT/big/dcba $MNT/big/dcab
+sed -i "/^dcba\$/d" $EXPECT
+echo dcab >> $EXPECT
+echo dcba >> $GONE
+check rename
+
+# Unlink, and recreate a few of the removed names
+i=2
+while [ $i -lt $N ]; do
+	if [ -e $MNT/big/file$i ]; then
+		rm $MNT/big/file$i
+		sed -i "/^file$i\$/d" $EXPECT
+		echo file$i >> $GONE
+	fi
+	i=$((i + 3))
+done
+rmdir $MNT/big/abdc
+sed -i "/^abdc\$/d" $EXPECT
+echo abdc >> $GONE
+for i in 2 5 8; do
+	echo again > $MNT/big/file$i
+	sed -i "/^file$i\$/d" $GONE
+	echo file$i >> $EXPECT
+done
+check unlink
+
+remount ""
+check "remount from checkpoint"
+remount "-o no-checkpoint-read"
+check "remount with summary scan"
+remount "-o no-checkpoint-read,no-summary"
+check "remount with full scan"
+
+echo PASS
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# nandsim-mount-bench.sh -- time yaffs2 mounts on a simulated NAND
+#
+# Loads nandsim, fills a yaffs2 filesystem on it with files, and then
+# times mounting it three ways:
+#
+#   checkpoint   the checkpoint written at the last unmount is used
+#   summary      no-checkpoint-read: the fallback scan, which reads one
+#                summary per block where one was written
+#   full         no-checkpoint-read,no-summary: the fallback scan reading
+#                the tags of every chunk, as before summaries existed
+#
+# Each mount is timed from userspace and by yaffs itself (mount_us in
+# /proc/yaffs), and the scan counters are shown next to the times.
+#
+# Needs root and a kernel with yaffs2, nandsim and mtdblock.
+#
+# usage: nandsim-mount-bench.sh [files] [file size in KiB] [runs]
+#
+# The NAND geometry can be changed through NANDSIM_ARGS, by default a
+# 256MiB chip with 2KiB pages.
+
+set -e
+
+FILES=${1:-2000}
+SIZE_KB=${2:-64}
+RUNS=${3:-3}
+NANDSIM_ARGS=${NANDSIM_ARGS:-"first_id_byte=0x20 second_id_byte=0xaa"}
+MNT=${TMPDIR:-/tmp}/yaffs-bench.$$
+
+cleanup()
+{
+	umount $MNT 2>/dev/null || true
+	rmdir $MNT 2>/dev/null || true
+	rmmod nandsim 2>/dev/null || true
+}
+trap cleanup EXIT
+
+proc_val()
+{
+	sed -n "s/^$1\.* *//p" /proc/yaffs | head -n 1
+}
+
+modprobe nandsim $NANDSIM_ARGS
+MTD=$(sed -n 's/^mtd\([0-9]*\):.*"NAND simulator.*/\1/p' /proc/mtd | head -n 1)
+if [ -z "$MTD" ]; then
+	echo "nandsim did not register an mtd device" >&2
+	exit 1
+fi
+DEV=/dev/mtdblock$MTD
+mkdir -p $MNT
+
+echo "filling $DEV with $FILES files of ${SIZE_KB}KiB"
+mount -t yaffs2 $DEV $MNT
+i=0
+while [ $i -lt $FILES ]; do
+	d=$MNT/d$((i / 100))
+	[ -d $d ] || mkdir $d
+	dd if=/dev/urandom of=$d/f$i bs=1024 count=$SIZE_KB 2>/dev/null
+	i=$((i + 1))
+done
+# Churn some files so that the scan sees deleted and shrunk data too
+i=0
+while [ $i -lt $FILES ]; do
+	rm $MNT/d$((i / 100))/f$i
+	i=$((i + 7))
+done
+umount $MNT
+
+printf "%-11s %10s %10s %8s %8s\n" mode wall_ms mount_ms summary full
+for mode in checkpoint summary full; do
+	case $mode in
+	checkpoint)	opts="" ;;
+	summary)	opts="-o no-checkpoint-read" ;;
+	full)		opts="-o no-checkpoint-read,no-summary" ;;
+	esac
+
+	run=0
+	while [ $run -lt $RUNS ]; do
+		start=$(date +%s%N)
+		mount -t yaffs2 $opts $DEV $MNT
+		end=$(date +%s%N)
+		printf "%-11s %10d %10d %8s %8s\n" $mode \
+			$(((end - start) / 1000000)) \
+			$(($(proc_val mount_us) / 1000)) \
+			$(proc_val n_summary_scans) $(proc_val n_full_scans)
+		umount $MNT
+		run=$((run + 1))
+	done
+done
@@ -0,0 +1,266 @@
+/*
+ * zram-bench.c -- compare zram compression backends on a page dump
+ *
+ * For every algorithm given, the zram device is reset, switched to that
+ * algorithm and filled with the dump through O_DIRECT writes. The dump
+ * is then read back and verified. The program reports the write and
+ * read rates and the compressed size and memory use that zram reports
+ * in sysfs.
+ *
+ * A representative dump of anonymous memory can be taken from a running
+ * process with -p: its private writable mappings are copied out of
+ * /proc/<pid>/mem (this needs ptrace access to it).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o zram-bench zram-bench.c */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PAGE_SIZE	4096
+
+static const char *zdev = "zram0";
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int sysfs_write(const char *attr, const char *val)
+{
+	char path[256];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", zdev, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, val, strlen(val)) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static unsigned long long sysfs_read(const char *attr)
+{
+	char path[256], buf[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", zdev, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n < 0)
+		die(path);
+	buf[n] = '\0';
+	return strtoull(buf, NULL, 0);
+}
+
+/* Copy the private writable mappings of @pid to @out */
+static void dump_anon(int pid, const char *out)
+{
+	char path[64], line[512];
+	unsigned long start, end, total = 0;
+	char perms[8];
+	char *page;
+	FILE *maps;
+	int mem, ofd;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	maps = fopen(path, "r");
+	if (!maps)
+		die(path);
+	snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+	mem = open(path, O_RDONLY);
+	if (mem < 0)
+		die(path);
+	ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ofd < 0)
+		die(out);
+	page = malloc(PAGE_SIZE);
+	if (!page)
+		die("malloc");
+
+	while (fgets(line, sizeof(line), maps)) {
+		unsigned long inode;
+		int n;
+
+		n = sscanf(line, "%lx-%lx %7s %*s %*s %lu", &start, &end,
+			   perms, &inode);
+		/* anonymous: no backing inode; heap and stack included */
+		if (n != 4 || perms[0] != 'r' || perms[1] != 'w' ||
+		    perms[3] != 'p' || inode != 0)
+			continue;
+		for (; start < end; start += PAGE_SIZE) {
+			if (pread(mem, page, PAGE_SIZE, start) != PAGE_SIZE)
+				continue;
+			if (write(ofd, page, PAGE_SIZE) != PAGE_SIZE)
+				die(out);
+			total++;
+		}
+	}
+
+	printf("dumped %lu anonymous pages of pid %d to %s\n", total, pid, out);
+	free(page);
+	close(ofd);
+	close(mem);
+	fclose(maps);
+}
+
+static void bench(const char *alg, const char *dump)
+{
+	char devpath[64], size[32];
+	double t, wtime, rtime;
+	unsigned long long orig, compr, used;
+	unsigned long pages, i;
+	char *buf, *cmp;
+	struct stat st;
+	int in, fd, ret;
+
+	in = open(dump, O_RDONLY);
+	if (in < 0 || fstat(in, &st))
+		die(dump);
+	pages = st.st_size / PAGE_SIZE;
+	if (!pages) {
+		fprintf(stderr, "%s: smaller than a page\n", dump);
+		exit(1);
+	}
+
+	sysfs_write("reset", "1");
+	ret = sysfs_write("comp_algorithm", alg);
+	if (ret) {
+		fprintf(stderr, "%s: %s: %s\n", zdev, alg, strerror(-ret));
+		close(in);
+		return;
+	}
+	snprintf(size, sizeof(size), "%llu",
+		 (unsigned long long)pages * PAGE_SIZE);
+	ret = sysfs_write("disksize", size);
+	if (ret) {
+		fprintf(stderr, "%s: disksize: %s\n", zdev, strerror(-ret));
+		exit(1);
+	}
+
+	if (posix_memalign((void **)&buf, PAGE_SIZE, PAGE_SIZE) ||
+	    posix_memalign((void **)&cmp, PAGE_SIZE, PAGE_SIZE))
+		die("posix_memalign");
+
+	snprintf(devpath, sizeof(devpath), "/dev/%s", zdev);
+	fd = open(devpath, O_RDWR | O_DIRECT);
+	if (fd < 0)
+		die(devpath);
+
+	t = now();
+	for (i = 0; i < pages; i++) {
+		if (pread(in, buf, PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE)
+			die(dump);
+		if (pwrite(fd, buf, PAGE_SIZE,
+			   (off_t)i * PAGE_SIZE) != PAGE_SIZE)
+			die(devpath);
+	}
+	fsync(fd);
+	wtime = now() - t;
+
+	orig = sysfs_read("orig_data_size");
+	compr = sysfs_read("compr_data_size");
+	used = sysfs_read("mem_used_total");
+
+	t = now();
+	for (i = 0; i < pages; i++) {
+		if (pread(fd, buf, PAGE_SIZE,
+			  (off_t)i * PAGE_SIZE) != PAGE_SIZE)
+			die(devpath);
+		if (pread(in, cmp, PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE)
+			die(dump);
+		if (memcmp(buf, cmp, PAGE_SIZE)) {
+			fprintf(stderr, "%s: page %lu differs\n", alg, i);
+			exit(1);
+		}
+	}
+	/* the comparison reads of the dump are in the page cache by now */
+	rtime = now() - t;
+
+	printf("%-10s %9.1f %9.1f %12llu %12llu %12llu %7.2f\n", alg,
+	       pages * (PAGE_SIZE / 1048576.0) / wtime,
+	       pages * (PAGE_SIZE / 1048576.0) / rtime,
+	       orig, compr, used, compr ? (double)orig / compr : 0.0);
+
+	close(fd);
+	close(in);
+	free(buf);
+	free(cmp);
+	sysfs_write("reset", "1");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d zramN] [-a alg,alg...] [-p pid] dumpfile\n"
+		"  -d  zram device to use, it will be reset (default %s)\n"
+		"  -a  backends to compare (default lzo,deflate)\n"
+		"  -p  first write the anonymous memory of pid to dumpfile\n",
+		prog, zdev);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char *algs = strdup("lzo,deflate");
+	char *alg, *save;
+	int pid = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:a:p:")) != -1) {
+		switch (c) {
+		case 'd':
+			zdev = optarg;
+			break;
+		case 'a':
+			algs = optarg;
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (pid)
+		dump_anon(pid, argv[optind]);
+
+	printf("%-10s %9s %9s %12s %12s %12s %7s\n", "backend", "wr MB/s",
+	       "rd MB/s", "orig", "compr", "mem_used", "ratio");
+	for (alg = strtok_r(algs, ",", &save); alg;
+	     alg = strtok_r(NULL, ",", &save))
+		bench(alg, argv[optind]);
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# zram-wb-test.sh -- exercise zram writeback against a loop device
+#
+# Backs a zram device with a loop device on a scratch file and fills it
+# with half compressible, half random pages. It then writes back the
+# incompressible ones ("huge") and, after writeback_idle_age seconds, the
+# idle ones. Finally it reads everything back and compares checksums,
+# while a second reader runs concurrently to catch reads that stall
+# behind backing device I/O.
+#
+# Needs root, losetup and a kernel with CONFIG_ZRAM.
+#
+# usage: zram-wb-test.sh [zramN] [pages]
+
+set -e
+
+ZDEV=${1:-zram0}
+PAGES=${2:-4096}
+SYS=/sys/block/$ZDEV
+TMP=${TMPDIR:-/tmp}/zram-wb.$$
+
+cleanup()
+{
+	echo 1 > $SYS/reset 2>/dev/null || true
+	[ -n "$LOOP" ] && losetup -d $LOOP 2>/dev/null || true
+	rm -rf $TMP
+}
+trap cleanup EXIT
+
+stat_of()
+{
+	cat $SYS/$1
+}
+
+mkdir -p $TMP
+dd if=/dev/zero of=$TMP/backing bs=4096 count=$PAGES 2>/dev/null
+LOOP=$(losetup -f)
+losetup $LOOP $TMP/backing
+
+echo 1 > $SYS/reset
+echo $LOOP > $SYS/backing_dev
+echo 1 > $SYS/writeback_idle_age
+echo $((PAGES * 4096)) > $SYS/disksize
+
+# Half text (compresses well), half random (incompressible)
+HALF=$((PAGES / 2))
+yes "zram writeback test pattern" | head -c $((HALF * 4096)) > $TMP/data
+dd if=/dev/urandom bs=4096 count=$((PAGES - HALF)) 2>/dev/null >> $TMP/data
+dd if=$TMP/data of=/dev/$ZDEV bs=4096 oflag=direct 2>/dev/null
+SUM=$(md5sum < $TMP/data)
+
+echo "stored:        $(stat_of orig_data_size) bytes, $(stat_of mem_used_total) used"
+
+echo huge > $SYS/writeback
+echo "after huge:    bd_count $(stat_of bd_count) bd_writes $(stat_of bd_writes)"
+
+sleep 2
+echo idle > $SYS/writeback
+echo "after idle:    bd_count $(stat_of bd_count) bd_writes $(stat_of bd_writes)" \
+	"mem_used $(stat_of mem_used_total)"
+
+# Two concurrent readers of the whole device
+dd if=/dev/$ZDEV of=$TMP/out2 bs=4096 iflag=direct 2>/dev/null &
+START=$(date +%s.%N)
+dd if=/dev/$ZDEV bs=4096 iflag=direct 2>/dev/null | md5sum > $TMP/sum1
+END=$(date +%s.%N)
+wait
+
+echo "read back:     bd_reads $(stat_of bd_reads)," \
+	"$(echo "$END - $START" | bc) s"
+
+if [ "$(cat $TMP/sum1)" != "$SUM" ] ||
+   [ "$(md5sum < $TMP/out2)" != "$SUM" ]; then
+	echo "FAIL: data read back differs"
+	exit 1
+fi
+echo "PASS"